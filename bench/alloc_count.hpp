@@ -0,0 +1,52 @@
+#pragma once
+// Counts heap allocations made by the process. Replaces the global operator new, so include it
+// from exactly one translation unit of a benchmark.
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+
+static std::atomic<size_t> g_allocs(0);
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete" // delete frees what new malloc'd
+#endif
+
+void *operator new(size_t size)
+{
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+void operator delete[](void *p, size_t) noexcept
+{
+    free(p);
+}
+
+// Allocations since the counter was created
+class AllocCount
+{
+    size_t start_ = g_allocs.load();
+
+public:
+    size_t operator()() const
+    {
+        return g_allocs.load() - start_;
+    }
+};
@@ -0,0 +1,84 @@
+// Heap allocations and time per uplink frame: HuoshanProto::TaskRequest and HuoshanFrame::Make
+// against the string-concatenating builder they replaced.
+#include "alloc_count.hpp"
+#include <lcm/lcm-cpp.hpp>
+#include "HuoshanEngine.hpp"
+
+#include <stdio.h>
+#include <vector>
+
+// The previous TaskRequest: header and every length field built as temporaries, then appended
+static std::string LegacyBytes(uint32_t d)
+{
+    std::string buffer(sizeof(d), '\0');
+    buffer[0] = (d >> 24) & 0xFF;
+    buffer[1] = (d >> 16) & 0xFF;
+    buffer[2] = (d >> 8) & 0xFF;
+    buffer[3] = d & 0xFF;
+    return buffer;
+}
+static std::string LegacyHeader(uint8_t message_type, uint8_t serialization)
+{
+    uint8_t header[4] = {(0x1 << 4) | 0x1, (uint8_t)((message_type << 4) | MSG_WITH_EVENT), (uint8_t)(serialization << 4), 0};
+    std::string buffer;
+    for (size_t i = 0; i < sizeof(header); i++)
+        buffer.push_back(header[i]);
+    return buffer;
+}
+static std::string LegacyTaskRequest(const std::string &session_id, const void *audio, size_t len)
+{
+    auto d = LegacyHeader(AUDIO_ONLY_REQ, NO_SERIALIZATION);
+    d += LegacyBytes(Event::TaskRequest);
+    d += LegacyBytes(session_id.length());
+    d += session_id;
+    auto payload_size = LegacyBytes(len);
+    d += LegacyBytes(len);
+    d.insert(d.end(), (const uint8_t *)audio, (const uint8_t *)audio + len);
+    return d;
+}
+static std::string LegacyControl(uint32_t event, const std::string &session_id, const std::string &json)
+{
+    auto d = LegacyHeader(FULL_CLIENT_REQ, JSON);
+    d += LegacyBytes(event);
+    d += LegacyBytes(session_id.length());
+    d += session_id;
+    d += LegacyBytes(json.length());
+    d += json;
+    return d;
+}
+
+template <class F>
+static void Run(const char *name, int frames, F f)
+{
+    size_t bytes = 0;
+    f(bytes); // warm up: the first call may size reusable buffers
+    AllocCount allocs;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++)
+        f(bytes);
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    printf("%-34s %6.2f allocs/frame %8.1f ns/frame  (%zu byte frames)\n", name, (double)allocs() / frames, ns / frames, bytes / (frames + 1));
+}
+
+int main(int argc, char *argv[])
+{
+    int frames = argc > 1 ? atoi(argv[1]) : 100000;
+    HuoshanProto proto("xdrobot_0123456789ab", "{\"dialog\":{}}", "hello");
+    std::string json = "{\"content\":\"hello\"}";
+    for (size_t len : {640, 1280})
+    {
+        std::vector<uint8_t> audio(len, 0x5a);
+        printf("TaskRequest, %zu byte payload\n", len);
+        Run("  legacy string concatenation", frames, [&](size_t &bytes)
+            { bytes += LegacyTaskRequest(proto.session_id, audio.data(), len).size(); });
+        Run("  HuoshanProto::TaskRequest", frames, [&](size_t &bytes)
+            { bytes += proto.TaskRequest(audio.data(), len).size(); });
+    }
+    printf("Control frame (SayHello payload)\n");
+    Run("  legacy string concatenation", frames, [&](size_t &bytes)
+        { bytes += LegacyControl(Event::SayHello, proto.session_id, json).size(); });
+    Run("  HuoshanFrame::Make", frames, [&](size_t &bytes)
+        { bytes += HuoshanFrame::Make(Event::SayHello, &proto.session_id, json).size(); });
+    printf("audio frame buffer grew %zu times\n", proto.audio_frame_grows);
+    return 0;
+}
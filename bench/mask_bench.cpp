@@ -0,0 +1,91 @@
+// Websocket client masking throughput: SimpleWeb::apply_mask over contiguous memory against the
+// per-byte iostream loop, with a std::random_device key per frame, that it replaced.
+#define SIMPLEWEB_USE_STANDALONE_ASIO 1
+#define ASIO_USE_TS_EXECUTOR_AS_DEFAULT 1
+#include "simpleweb/ws_client.hpp"
+
+#include <stdio.h>
+#include <chrono>
+#include <random>
+#include <vector>
+
+using OutMessage = SimpleWeb::WsClient::OutMessage;
+
+// The previous Connection::send: key from a fresh random_device, payload masked through get()/put()
+static std::shared_ptr<OutMessage> LegacyMask(const std::shared_ptr<OutMessage> &out_message, std::array<unsigned char, 4> *key)
+{
+    std::array<unsigned char, 4> mask;
+    std::uniform_int_distribution<unsigned short> dist(0, 255);
+    std::random_device rd;
+    for (std::size_t c = 0; c < 4; c++)
+        mask[c] = static_cast<unsigned char>(dist(rd));
+    std::size_t length = out_message->size();
+    auto out = std::make_shared<OutMessage>(length + 14);
+    out->put(static_cast<char>(130));
+    if (length >= 126)
+    {
+        std::size_t num_bytes = length > 0xffff ? 8 : 2;
+        out->put(static_cast<char>(num_bytes == 8 ? 127 + 128 : 126 + 128));
+        for (std::size_t c = num_bytes - 1; c != static_cast<std::size_t>(-1); c--)
+            out->put((static_cast<unsigned long long>(length) >> (8 * c)) % 256);
+    }
+    else
+        out->put(static_cast<char>(length + 128));
+    for (std::size_t c = 0; c < 4; c++)
+        out->put(static_cast<char>(mask[c]));
+    for (std::size_t c = 0; c < length; c++)
+        out->put(out_message->get() ^ mask[c % 4]);
+    *key = mask;
+    return out;
+}
+
+template <class F>
+static double UsPerFrame(int frames, F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++)
+        f();
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / frames;
+}
+
+int main(int argc, char *argv[])
+{
+    int frames = argc > 1 ? atoi(argv[1]) : 20000;
+    std::minstd_rand rand;
+    for (std::size_t length : {640, 1316, 3840})
+    {
+        std::vector<unsigned char> payload(length);
+        for (auto &b : payload)
+            b = static_cast<unsigned char>(rand());
+
+        // Same key, same bytes: the two paths must agree
+        std::array<unsigned char, 4> key;
+        auto legacy_in = std::make_shared<OutMessage>();
+        legacy_in->write(reinterpret_cast<const char *>(payload.data()), length);
+        auto legacy_out = LegacyMask(legacy_in, &key);
+        std::vector<unsigned char> masked(length);
+        SimpleWeb::apply_mask(masked.data(), payload.data(), length, key);
+        std::vector<unsigned char> legacy_frame(legacy_out->size());
+        legacy_out->read(reinterpret_cast<char *>(legacy_frame.data()), legacy_frame.size());
+        bool same = memcmp(legacy_frame.data() + legacy_frame.size() - length, masked.data(), length) == 0;
+
+        double legacy_us = UsPerFrame(frames, [&]()
+        {
+            auto in = std::make_shared<OutMessage>();
+            in->write(reinterpret_cast<const char *>(payload.data()), length);
+            LegacyMask(in, &key);
+        });
+        std::uint64_t state = 0x9e3779b97f4a7c15ULL;
+        double apply_us = UsPerFrame(frames, [&]()
+        {
+            state += 0x9e3779b97f4a7c15ULL;
+            std::array<unsigned char, 4> mask;
+            for (std::size_t c = 0; c < 4; c++)
+                mask[c] = static_cast<unsigned char>(state >> (8 * c));
+            SimpleWeb::apply_mask(masked.data(), payload.data(), length, mask);
+        });
+        printf("%5zu bytes: per-byte iostream %7.2f us/frame (%6.1f MB/s), apply_mask %6.3f us/frame (%7.1f MB/s)%s\n",
+               length, legacy_us, length / legacy_us, apply_us, length / apply_us, same ? "" : "  OUTPUT DIFFERS");
+    }
+    return 0;
+}
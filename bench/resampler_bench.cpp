@@ -0,0 +1,115 @@
+// PcmConverter resampling: the polyphase fast path from CreateResampler against the
+// ma_data_converter it replaces, on 20 ms mono chunks. Decimation is scored by the level of a
+// tone at 1.25x the output Nyquist (it should vanish), interpolation by the level of a tone at
+// 0.75x the input Nyquist (it should stay at 0 dB).
+#include "resampler.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+struct Case
+{
+    const char *name;
+    ma_format inFormat;
+    int inRate;
+    ma_format outFormat;
+    int outRate;
+};
+
+// Tone of the given frequency at 0.5 full scale, in the input format
+static std::vector<char> Tone(ma_format format, int rate, double hz, int frames)
+{
+    std::vector<char> buf(frames * ma_get_bytes_per_sample(format));
+    for (int i = 0; i < frames; i++)
+    {
+        double v = 0.5 * sin(2 * M_PI * hz * i / rate);
+        if (format == ma_format_f32)
+            ((float *)buf.data())[i] = (float)v;
+        else
+            ((int16_t *)buf.data())[i] = (int16_t)(v * 32767);
+    }
+    return buf;
+}
+
+// Level relative to the 0.5 full-scale input, skipping the filter warm-up; floored at the s16 LSB
+static double LevelDb(ma_format format, const std::vector<char> &buf, int frames, int skip)
+{
+    double sum = 0;
+    for (int i = skip; i < frames; i++)
+    {
+        double v = format == ma_format_f32 ? ((const float *)buf.data())[i] : ((const int16_t *)buf.data())[i] / 32767.0;
+        sum += v * v;
+    }
+    double rms = std::max(sqrt(sum / (frames - skip)), 1 / 32768.0);
+    return 20 * log10(rms / (0.5 / sqrt(2.0)));
+}
+
+// Feeds the input in 20 ms chunks; returns us per chunk and the output level in *db
+template <class F>
+static double Run(const Case &c, const std::vector<char> &in, int chunks, F process, double *db)
+{
+    int inChunk = c.inRate / 50, outChunk = c.outRate / 50 + 1;
+    int inBytes = inChunk * ma_get_bytes_per_sample(c.inFormat);
+    int outBytes = ma_get_bytes_per_sample(c.outFormat);
+    std::vector<char> out((size_t)chunks * outChunk * outBytes);
+    int produced = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < chunks; i++)
+    {
+        ma_uint64 inFrames = inChunk, outFrames = outChunk;
+        process(in.data() + (size_t)i * inBytes, &inFrames, out.data() + (size_t)produced * outBytes, &outFrames);
+        produced += (int)outFrames;
+    }
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / chunks;
+    *db = LevelDb(c.outFormat, out, produced, c.outRate / 10);
+    return us;
+}
+
+int main(int argc, char *argv[])
+{
+    int chunks = argc > 1 ? atoi(argv[1]) : 2000;
+    const Case cases[] = {
+        {"24k->8k f32", ma_format_f32, 24000, ma_format_f32, 8000},
+        {"24k->8k f32->s16", ma_format_f32, 24000, ma_format_s16, 8000},
+        {"16k->8k s16", ma_format_s16, 16000, ma_format_s16, 8000},
+        {"24k->16k s16", ma_format_s16, 24000, ma_format_s16, 16000},
+        {"8k->16k s16", ma_format_s16, 8000, ma_format_s16, 16000},
+    };
+    printf("%-18s %8s %26s %26s\n", "", "tone", "ma_data_converter", "polyphase");
+    for (const Case &c : cases)
+    {
+        bool down = c.outRate < c.inRate;
+        double hz = down ? 1.25 * c.outRate / 2 : 0.75 * c.inRate / 2;
+        auto in = Tone(c.inFormat, c.inRate, hz, chunks * (c.inRate / 50));
+
+        ma_data_converter_config config = ma_data_converter_config_init(c.inFormat, c.outFormat, 1, 1, c.inRate, c.outRate);
+        ma_data_converter converter;
+        if (ma_data_converter_init(&config, NULL, &converter) != MA_SUCCESS)
+        {
+            printf("%s: ma_data_converter_init failed\n", c.name);
+            return 1;
+        }
+        auto fast = CreateResampler(c.inFormat, c.inRate, 1, c.outFormat, c.outRate, 1);
+        if (!fast)
+        {
+            printf("%s: no polyphase kernel\n", c.name);
+            return 1;
+        }
+
+        double ma_db, fast_db;
+        double ma_us = Run(c, in, chunks, [&](const void *i, ma_uint64 *n, void *o, ma_uint64 *m) {
+            ma_data_converter_process_pcm_frames(&converter, i, n, o, m);
+        }, &ma_db);
+        double fast_us = Run(c, in, chunks, [&](const void *i, ma_uint64 *n, void *o, ma_uint64 *m) {
+            fast->Process(i, n, o, m);
+        }, &fast_db);
+        ma_data_converter_uninit(&converter, NULL);
+
+        printf("%-18s %6.0fHz %9.1f us/chunk %6.1f dB %9.1f us/chunk %6.1f dB\n",
+               c.name, hz, ma_us, ma_db, fast_us, fast_db);
+    }
+    return 0;
+}
@@ -0,0 +1,148 @@
+// Websocket client receive path: replays a TTS downlink through a loopback server and counts
+// read handlers, heap allocations and bytes copied per frame on the way to on_message.
+//
+//   ws_read_bench [capture.bin|-] [segment_bytes]
+//
+// capture.bin holds the server frames of a captured stream as they arrived after the upgrade
+// response. Without one (or with -), a synthetic stream of Huoshan TTSResponse frames carrying 24 kHz f32
+// audio in 20-60 ms chunks is used.
+#include "alloc_count.hpp"
+#define SIMPLEWEB_USE_STANDALONE_ASIO 1
+#define ASIO_USE_TS_EXECUTOR_AS_DEFAULT 1
+#include "simpleweb/ws_client.hpp"
+
+#include <stdio.h>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <thread>
+#include <vector>
+
+using SimpleWeb::WsClient;
+
+static void PutU32(std::string &s, uint32_t d)
+{
+    for (int c = 3; c >= 0; c--)
+        s.push_back(static_cast<char>((d >> (8 * c)) & 0xFF));
+}
+
+// One unmasked server frame around payload
+static void PutFrame(std::string &s, unsigned char fin_rsv_opcode, const std::string &payload)
+{
+    s.push_back(static_cast<char>(fin_rsv_opcode));
+    if (payload.size() >= 126)
+    {
+        int num_bytes = payload.size() > 0xffff ? 8 : 2;
+        s.push_back(static_cast<char>(num_bytes == 8 ? 127 : 126));
+        for (int c = num_bytes - 1; c >= 0; c--)
+            s.push_back(static_cast<char>((static_cast<unsigned long long>(payload.size()) >> (8 * c)) & 0xFF));
+    }
+    else
+        s.push_back(static_cast<char>(payload.size()));
+    s += payload;
+}
+
+static std::string SyntheticTts(int frames)
+{
+    std::string stream;
+    std::minstd_rand rand;
+    const std::string session_id = "xdrobot_0123456789ab";
+    for (int i = 0; i < frames; i++)
+    {
+        std::string payload = {0x11, static_cast<char>(0xB4), 0x00, 0x00}; // AUDIO_ONLY_RSP with event, raw
+        PutU32(payload, 352);                                              // TTSResponse
+        PutU32(payload, session_id.size());
+        payload += session_id;
+        size_t audio = 24 * 4 * (20 + rand() % 41); // 20-60 ms of 24 kHz f32
+        PutU32(payload, audio);
+        payload.append(audio, static_cast<char>(i));
+        PutFrame(stream, 130, payload);
+    }
+    return stream;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string stream;
+    if (argc > 1 && strcmp(argv[1], "-") != 0)
+    {
+        std::ifstream file(argv[1], std::ios::binary);
+        stream.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        if (stream.empty())
+        {
+            printf("Can't read %s\n", argv[1]);
+            return 1;
+        }
+    }
+    else
+        stream = SyntheticTts(2000);
+    size_t segment = argc > 2 ? atoi(argv[2]) : 1448; // one TCP segment at a 1500 byte MTU
+    PutFrame(stream, 136, std::string("\x03\xe8", 2)); // close 1000
+
+    asio::io_context server_io;
+    asio::ip::tcp::acceptor acceptor(server_io, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    unsigned short port = acceptor.local_endpoint().port();
+    std::thread server([&]()
+    {
+        asio::ip::tcp::socket socket(server_io);
+        acceptor.accept(socket);
+        asio::streambuf request;
+        asio::read_until(socket, request, "\r\n\r\n");
+        std::istream in(&request);
+        std::string line, key;
+        while (std::getline(in, line) && line != "\r")
+        {
+            if (line.compare(0, 19, "Sec-WebSocket-Key: ") == 0)
+                key = line.substr(19, line.size() - 20);
+        }
+        std::string response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                               "Sec-WebSocket-Accept: " +
+                               SimpleWeb::Crypto::Base64::encode(SimpleWeb::Crypto::sha1(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11")) + "\r\n\r\n";
+        asio::write(socket, asio::buffer(response));
+        for (size_t off = 0; off < stream.size(); off += segment)
+            asio::write(socket, asio::buffer(&stream[off], std::min(segment, stream.size() - off)));
+        asio::error_code ec;
+        std::array<char, 64> drain; // the client's close reply
+        socket.read_some(asio::buffer(drain), ec);
+    });
+
+    WsClient client("127.0.0.1:" + std::to_string(port) + "/");
+    size_t messages = 0, payload_bytes = 0, allocs = 0;
+    unsigned checksum = 0;
+    std::unique_ptr<AllocCount> counting;
+    std::chrono::steady_clock::time_point start, end;
+    client.on_open = [&](std::shared_ptr<WsClient::Connection>)
+    {
+        counting.reset(new AllocCount);
+        start = std::chrono::steady_clock::now();
+    };
+    client.on_message = [&](std::shared_ptr<WsClient::Connection>, std::shared_ptr<WsClient::InMessage> message)
+    {
+        // What the engine does: read the payload in place
+        const char *data = message->data();
+        for (size_t i = 0; i < message->size(); i += 64)
+            checksum += static_cast<unsigned char>(data[i]);
+        payload_bytes += message->size();
+        messages++;
+    };
+    client.on_close = [&](std::shared_ptr<WsClient::Connection> connection, int, const std::string &)
+    {
+        end = std::chrono::steady_clock::now();
+        allocs = (*counting)();
+        printf("%zu messages, %.1f MB in %zu byte segments, %.1f ms\n", messages, payload_bytes / 1e6, segment,
+               std::chrono::duration<double, std::milli>(end - start).count());
+        printf("read handlers: %zu (%.3f per frame)\n", connection->read_count.load(),
+               (double)connection->read_count.load() / connection->read_frames.load());
+        printf("heap allocations while streaming: %zu (%.3f per frame), InMessage allocations %zu\n", allocs,
+               (double)allocs / connection->read_frames.load(), connection->in_message_allocs.load());
+        printf("checksum %u\n", checksum);
+    };
+    client.on_error = [&](std::shared_ptr<WsClient::Connection>, const SimpleWeb::error_code &ec)
+    {
+        printf("Client error: %s\n", ec.message().c_str());
+    };
+    client.start();
+    server.join();
+    return 0;
+}
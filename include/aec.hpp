@@ -0,0 +1,385 @@
+#pragma once
+#include <stdint.h>
+#include <math.h>
+#include <chrono>
+#include <complex>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+#include "sound.hpp"
+#include "fft.hpp"
+
+struct AecConfig
+{
+    bool enabled = true;
+    int delay_ms = 10;        // playback-to-capture delay taken out before the filter, keep it below the real one
+    int tail_ms = 160;        // echo path length the adaptive filter covers after delay_ms
+    float mu = 0.3f;          // adaptation step, 0..1
+    float dtd_ratio = 2.0f;   // residual above this times the echo estimate means the near end is talking
+};
+
+// Acoustic echo canceller: a partitioned-block frequency-domain adaptive filter (MDF) per
+// capture channel, driven by PlayDev's reference tap, with double-talk detection. Capture
+// audio is processed in place and delayed by one block (8 ms). Single-threaded: call
+// Process() from the thread that reads the capture ring.
+class EchoCanceller
+{
+private:
+    using Complex = std::complex<float>;
+
+    AecConfig config_;
+    PcmRing *reference_;  // playback output, written by PlayDev's callback
+    ma_format ref_format_;
+    int ref_rate_;
+    int ref_channels_;
+    ma_format format_;
+    int sample_rate_;
+    int channels_;
+    std::unique_ptr<PcmConverter> ref_converter_; // reference to the capture rate, when they differ
+
+    int block_;       // B new samples per block, the FFT size is 2B
+    int partitions_;  // P blocks of filter
+    Fft fft_;
+    std::vector<Complex> x_spectra_;  // P spectra of [previous, current] reference block, newest at x_head_
+    int x_head_ = 0;
+    std::vector<float> x_norm_;       // per bin: reference power summed over the partitions
+    std::vector<std::vector<Complex>> w_; // per channel: P filter spectra
+    std::vector<float> x_block_;      // reference, previous and current block
+    std::vector<std::vector<float>> d_block_; // per channel: capture, current block
+    std::vector<std::vector<float>> e_out_;   // per channel: cancelled previous block, being returned
+    int fill_ = 0;                    // samples of the current block filled
+    uint64_t blocks_ = 0;
+    std::vector<Complex> scratch_;
+    std::vector<Complex> grad_;
+
+    // Reference alignment, in reference frames: the tap ring plus ref_pending_ should hold
+    // delay_ms more than what the capture side has consumed
+    std::vector<uint8_t> ref_bytes_;
+    std::vector<float> ref_mono_;
+    std::vector<float> ref_pending_;  // reference at the capture rate, not yet consumed
+    double ref_frac_ = 0;
+    double ref_fill_avg_ = -1;
+
+    // Double-talk and convergence state
+    float erle_smooth_db_ = 0;
+    int dt_run_ = 0;  // consecutive double-talk blocks
+    int since_far_ = 1 << 20;         // blocks since the last block with playback
+    double erle_d_ = 0, erle_e_ = 0; // capture and residual energy for Erle()
+
+    static float ToFloat(const uint8_t *data, ma_format format, size_t i)
+    {
+        return format == ma_format_f32 ? ((const float *)data)[i] : ((const int16_t *)data)[i] * (1.0f / 32768.0f);
+    }
+
+    static void FromFloat(uint8_t *data, ma_format format, size_t i, float x)
+    {
+        if (format == ma_format_f32)
+        {
+            ((float *)data)[i] = x;
+        }
+        else
+        {
+            x *= 32768.0f;
+            ((int16_t *)data)[i] = (int16_t)(x >= 32767.0f ? 32767 : x <= -32768.0f ? -32768 : lrintf(x));
+        }
+    }
+
+    double RefPerCapture() const
+    {
+        return (double)ref_rate_ / sample_rate_;
+    }
+
+    // Pulls n capture-rate reference samples into ref_mono_, keeping the tap delay_ms ahead
+    void ReadReference(size_t n)
+    {
+        size_t bpf = ma_get_bytes_per_frame(ref_format_, ref_channels_);
+        double want = n * RefPerCapture() + ref_frac_;
+        size_t take = (size_t)want;
+        ref_frac_ = want - take;
+
+        double fill = reference_->size() / bpf + ref_pending_.size() * RefPerCapture();
+        ref_fill_avg_ = ref_fill_avg_ < 0 ? fill : ref_fill_avg_ + (fill - ref_fill_avg_) * 0.05;
+        double error = ref_fill_avg_ - (config_.delay_ms * ref_rate_ / 1000.0 + want);
+        if (fabs(error) > ref_rate_ / 50.0) // 20 ms
+        {
+            resyncs++;
+            if (error > 0)
+            {
+                size_t drop = std::min((size_t)error, reference_->size() / bpf);
+                reference_->commit_read(drop * bpf);
+                ref_fill_avg_ -= drop;
+            }
+            else
+            {
+                ref_pending_.insert(ref_pending_.begin(), (size_t)(-error / RefPerCapture()), 0.0f);
+                ref_fill_avg_ -= error;
+            }
+        }
+
+        ref_bytes_.resize(take * bpf);
+        size_t got = reference_->read(ref_bytes_.data(), ref_bytes_.size()) / bpf;
+        ref_mono_.resize(got);
+        for (size_t i = 0; i < got; i++)
+            ref_mono_[i] = ToFloat(ref_bytes_.data(), ref_format_, i * ref_channels_);
+        if (ref_converter_)
+        {
+            std::vector<uint8_t> out = ref_converter_->Convert(ref_mono_.data(), ref_mono_.size() * sizeof(float));
+            ref_pending_.insert(ref_pending_.end(), (const float *)out.data(), (const float *)(out.data() + out.size()));
+        }
+        else
+        {
+            ref_pending_.insert(ref_pending_.end(), ref_mono_.begin(), ref_mono_.end());
+        }
+
+        size_t have = std::min(n, ref_pending_.size());
+        ref_mono_.assign(ref_pending_.begin(), ref_pending_.begin() + have);
+        ref_mono_.resize(n, 0.0f); // playback stalled: no echo to cancel
+        ref_pending_.erase(ref_pending_.begin(), ref_pending_.begin() + have);
+    }
+
+    Complex *XSpectrum(int p)
+    {
+        return &x_spectra_[((x_head_ + p) % partitions_) * 2 * block_];
+    }
+
+    void ProcessBlock()
+    {
+        const int B = block_, N = 2 * B;
+
+        // Newest reference spectrum and the per-bin power over the filter length
+        x_head_ = (x_head_ + partitions_ - 1) % partitions_;
+        Complex *x0 = XSpectrum(0);
+        for (int i = 0; i < N; i++)
+            x0[i] = x_block_[i];
+        fft_.Forward(x0);
+        float ex = 0;
+        for (int i = B; i < N; i++)
+            ex += x_block_[i] * x_block_[i];
+        std::fill(x_norm_.begin(), x_norm_.end(), 0.0f);
+        for (int p = 0; p < partitions_; p++)
+        {
+            Complex *x = XSpectrum(p);
+            for (int k = 0; k < N; k++)
+                x_norm_[k] += std::norm(x[k]);
+        }
+        // Regularized at about -50 dBFS so that quiet playback does not blow up the step
+        const float delta = N * B * 1e-5f;
+        bool far_active = ex > B * 1e-6f; // above -60 dBFS
+
+        bool double_talk = false;
+        for (int c = 0; c < channels_; c++)
+        {
+            // Echo estimate: last B samples of IFFT(sum W_p X_p)
+            std::fill(scratch_.begin(), scratch_.end(), Complex());
+            for (int p = 0; p < partitions_; p++)
+            {
+                const Complex *x = XSpectrum(p);
+                const Complex *w = &w_[c][p * N];
+                for (int k = 0; k < N; k++)
+                    scratch_[k] += w[k] * x[k];
+            }
+            fft_.Inverse(scratch_.data());
+
+            std::vector<float> &d = d_block_[c];
+            std::vector<float> &e = e_out_[c];
+            float ed = 0, ee = 0, ey = 0;
+            for (int i = 0; i < B; i++)
+            {
+                float y = scratch_[B + i].real();
+                e[i] = d[i] - y;
+                ed += d[i] * d[i];
+                ee += e[i] * e[i];
+                ey += y * y;
+            }
+
+            // Double talk, decided on the first channel for all: once converged, a residual well
+            // above the echo estimate is the near end speaking, adapting on it would cancel the
+            // talker. Persisting for a second with playback running means the echo path moved,
+            // so start over.
+            if (c == 0)
+            {
+                double_talk = far_active && converged() && ee > config_.dtd_ratio * ey;
+                dt_run_ = double_talk ? dt_run_ + 1 : 0;
+                since_far_ = far_active ? 0 : since_far_ + 1;
+                if (far_active)
+                {
+                    far_blocks++;
+                    if (double_talk)
+                        double_talk_blocks++;
+                    else
+                    {
+                        erle_d_ += ed;
+                        erle_e_ += ee;
+                    }
+                    if (ed > 0 && ee > 0)
+                        erle_smooth_db_ += (10 * log10f(ed / ee) - erle_smooth_db_) * 0.05f;
+                }
+            }
+            if (!far_active || double_talk)
+                continue;
+
+            // NLMS update of every partition with the gradient X_p^* E, E = FFT([0, e])
+            for (int i = 0; i < B; i++)
+            {
+                grad_[i] = 0.0f;
+                grad_[B + i] = e[i];
+            }
+            fft_.Forward(grad_.data());
+            for (int k = 0; k < N; k++)
+                grad_[k] *= config_.mu / (x_norm_[k] + delta);
+            for (int p = 0; p < partitions_; p++)
+            {
+                const Complex *x = XSpectrum(p);
+                Complex *w = &w_[c][p * N];
+                for (int k = 0; k < N; k++)
+                    w[k] += std::conj(x[k]) * grad_[k];
+            }
+            // Keep one partition per block causal (zero its second half in time), round robin
+            Complex *w = &w_[c][(blocks_ % partitions_) * N];
+            fft_.Inverse(w);
+            for (int i = B; i < N; i++)
+                w[i] = 0.0f;
+            fft_.Forward(w);
+        }
+
+        if (dt_run_ > sample_rate_ / B)
+        {
+            erle_smooth_db_ = 0;
+            dt_run_ = 0;
+        }
+        std::copy(x_block_.begin() + B, x_block_.end(), x_block_.begin());
+        blocks_++;
+    }
+
+public:
+    // Statistics since the last ResetStats()
+    uint64_t far_blocks = 0;          // blocks with playback
+    uint64_t double_talk_blocks = 0;  // of those, blocks with the near end talking too
+    uint64_t resyncs = 0;             // reference realigned to delay_ms
+    double cpu_us = 0;                // time spent in Process()
+    double audio_s = 0;               // capture audio processed
+
+    EchoCanceller(PcmRing *reference, int ref_rate, int ref_format, int ref_channels,
+                  int sample_rate, int format, int channels)
+        : reference_(reference), ref_format_((ma_format)ref_format), ref_rate_(ref_rate), ref_channels_(ref_channels),
+          format_((ma_format)format), sample_rate_(sample_rate), channels_(channels),
+          block_(BlockSize(sample_rate)), partitions_(1), fft_(2 * block_)
+    {
+        if (ref_rate != sample_rate)
+            ref_converter_.reset(new PcmConverter(ma_format_f32, ref_rate, 1, ma_format_f32, sample_rate, 1));
+        Configure(config_);
+    }
+
+    // 8 ms at 8 kHz, the same duration rounded up to a power of two at other rates
+    static int BlockSize(int sample_rate)
+    {
+        int n = 1;
+        while (n < sample_rate / 125)
+            n <<= 1;
+        return n;
+    }
+
+    void Configure(const AecConfig &config)
+    {
+        config_ = config;
+        const int N = 2 * block_;
+        partitions_ = std::max(1, (config.tail_ms * sample_rate_ / 1000 + block_ - 1) / block_);
+        x_spectra_.assign(partitions_ * N, Complex());
+        x_head_ = 0;
+        x_norm_.assign(N, 0.0f);
+        w_.assign(channels_, std::vector<Complex>(partitions_ * N));
+        x_block_.assign(N, 0.0f);
+        d_block_.assign(channels_, std::vector<float>(block_, 0.0f));
+        e_out_.assign(channels_, std::vector<float>(block_, 0.0f));
+        fill_ = 0;
+        scratch_.resize(N);
+        grad_.resize(N);
+        ref_fill_avg_ = -1;
+        erle_smooth_db_ = 0;
+        dt_run_ = 0;
+        since_far_ = 1 << 20;
+    }
+
+    const AecConfig &config() const
+    {
+        return config_;
+    }
+
+    // The filter models the echo path, so a residual above the echo estimate is not echo
+    bool converged() const
+    {
+        return erle_smooth_db_ > 6;
+    }
+
+    // How long the near end has been talking over the playback without a break, in ms
+    int double_talk_ms() const
+    {
+        return dt_run_ * block_ * 1000 / sample_rate_;
+    }
+
+    // Playback reached the capture within the last ms milliseconds
+    bool far_active(int ms = 100) const
+    {
+        return (int64_t)since_far_ * block_ * 1000 < (int64_t)ms * sample_rate_;
+    }
+
+    // Echo return loss enhancement over playback blocks without double talk, in dB
+    double Erle() const
+    {
+        return erle_e_ > 0 ? 10 * log10(erle_d_ / erle_e_) : 0;
+    }
+
+    // Playback-to-capture delay of the strongest filter tap, for tuning delay_ms
+    double EchoDelayMs()
+    {
+        const int N = 2 * block_;
+        int best = 0;
+        float peak = 0;
+        for (int p = 0; p < partitions_; p++)
+        {
+            std::copy(w_[0].begin() + p * N, w_[0].begin() + (p + 1) * N, scratch_.begin());
+            fft_.Inverse(scratch_.data());
+            for (int i = 0; i < block_; i++)
+                if (std::abs(scratch_[i]) > peak)
+                {
+                    peak = std::abs(scratch_[i]);
+                    best = p * block_ + i;
+                }
+        }
+        return config_.delay_ms + 1000.0 * best / sample_rate_;
+    }
+
+    void ResetStats()
+    {
+        far_blocks = double_talk_blocks = resyncs = 0;
+        cpu_us = audio_s = 0;
+        erle_d_ = erle_e_ = 0;
+    }
+
+    // Cancels the echo in captured audio, in place
+    void Process(uint8_t *data, size_t size)
+    {
+        if (!config_.enabled)
+            return;
+        auto start = std::chrono::steady_clock::now();
+        size_t frames = size / ma_get_bytes_per_frame(format_, channels_);
+        ReadReference(frames);
+        for (size_t i = 0; i < frames; i++)
+        {
+            x_block_[block_ + fill_] = ref_mono_[i];
+            for (int c = 0; c < channels_; c++)
+            {
+                d_block_[c][fill_] = ToFloat(data, format_, i * channels_ + c);
+                FromFloat(data, format_, i * channels_ + c, e_out_[c][fill_]);
+            }
+            if (++fill_ == block_)
+            {
+                ProcessBlock();
+                fill_ = 0;
+            }
+        }
+        cpu_us += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        audio_s += (double)frames / sample_rate_;
+    }
+};
@@ -0,0 +1,357 @@
+#pragma once
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <alsa/asoundlib.h>
+#include "sound.hpp"
+
+// Drives a PlayDev and a RecordDev straight from the ALSA DMA buffers, in place of their
+// miniaudio devices. Registered callbacks get pointers into the mmap areas
+// (snd_pcm_mmap_begin/commit), so the mixer writes and the capture consumers read the hardware
+// ring with no copy in between. One thread polls both PCMs; they are linked to start together
+// when the driver allows it, and restarted after an xrun. Format, channels and rate must be
+// native to the device: a hw: device gives zero copy, a plug device emulates mmap with a copy
+// of its own. The tuning profile of the PlayDev applies to both. If a stream can't be restarted
+// the thread stops, failed() turns true and on_failure is called so the owner can fall back.
+// Only built with cmake -DAIXD_ALSA_MMAP=ON; the default build does not include this header.
+class AlsaMmapDev
+{
+    struct Stream
+    {
+        SoundDev *dev;
+        snd_pcm_stream_t dir;
+        std::string name;
+        snd_pcm_t *pcm;
+        snd_pcm_format_t format;
+        snd_pcm_uframes_t period;
+        snd_pcm_uframes_t buffer;
+        int first_fd; // poll descriptors of this PCM in fds_
+        int nfds;
+    };
+
+    PlayDev &play_;
+    RecordDev &record_;
+    Stream streams_[2]; // playback, capture
+    bool linked_ = false;
+    std::vector<struct pollfd> fds_; // both PCMs, then stop_fd_
+    int stop_fd_ = -1;
+    std::thread thread_;
+    std::atomic<bool> running_;
+    std::atomic<int> error_; // why the thread gave up, 0 while it runs
+
+    static const int MaxRetries = 5; // restarts after an xrun, 10 ms apart and doubling
+
+    static snd_pcm_format_t AlsaFormat(uint32_t format)
+    {
+        switch ((ma_format)format)
+        {
+        case ma_format_u8:
+            return SND_PCM_FORMAT_U8;
+        case ma_format_s16:
+            return SND_PCM_FORMAT_S16_LE;
+        case ma_format_s24:
+            return SND_PCM_FORMAT_S24_3LE;
+        case ma_format_s32:
+            return SND_PCM_FORMAT_S32_LE;
+        case ma_format_f32:
+            return SND_PCM_FORMAT_FLOAT_LE;
+        default:
+            return SND_PCM_FORMAT_UNKNOWN;
+        }
+    }
+
+    int Setup(Stream &s)
+    {
+        const AudioTuning &tuning = play_.tuning;
+        SoundDev &dev = *s.dev;
+        int err;
+        if ((err = snd_pcm_open(&s.pcm, s.name.c_str(), s.dir, SND_PCM_NONBLOCK)) < 0)
+        {
+            printf("ERROR: Can't open PCM device %s (%s)\n", s.name.c_str(), snd_strerror(err));
+            s.pcm = nullptr;
+            return err;
+        }
+        const char *what = nullptr;
+        snd_pcm_hw_params_t *hw;
+        snd_pcm_hw_params_alloca(&hw);
+        unsigned int rate = dev.sample_rate;
+        unsigned int periods = tuning.periods > 0 ? tuning.periods : 3;
+        s.format = AlsaFormat(dev.sample_format);
+        s.period = tuning.period_ms > 0 ? dev.sample_rate * tuning.period_ms / 1000 : dev.frames_per_buffer;
+        if ((err = snd_pcm_hw_params_any(s.pcm, hw)) < 0)
+            what = "hw params";
+        else if ((err = snd_pcm_hw_params_set_rate_resample(s.pcm, hw, 0)) < 0)
+            what = "resampling off";
+        else if ((err = snd_pcm_hw_params_set_access(s.pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0)
+            what = "mmap interleaved access";
+        else if ((err = snd_pcm_hw_params_set_format(s.pcm, hw, s.format)) < 0)
+            what = "format";
+        else if ((err = snd_pcm_hw_params_set_channels(s.pcm, hw, dev.channels)) < 0)
+            what = "channels";
+        else if ((err = snd_pcm_hw_params_set_rate(s.pcm, hw, rate, 0)) < 0)
+            what = "rate";
+        else if ((err = snd_pcm_hw_params_set_period_size_near(s.pcm, hw, &s.period, nullptr)) < 0)
+            what = "period size";
+        else if ((err = snd_pcm_hw_params_set_periods_near(s.pcm, hw, &periods, nullptr)) < 0)
+            what = "periods";
+        else if ((err = snd_pcm_hw_params(s.pcm, hw)) < 0)
+            what = "hw params";
+        if (what == nullptr)
+        {
+            snd_pcm_hw_params_get_period_size(hw, &s.period, nullptr);
+            snd_pcm_hw_params_get_buffer_size(hw, &s.buffer);
+            // Wake up every period; start only when Start() says so
+            snd_pcm_sw_params_t *sw;
+            snd_pcm_sw_params_alloca(&sw);
+            snd_pcm_uframes_t boundary = 0;
+            if ((err = snd_pcm_sw_params_current(s.pcm, sw)) < 0 ||
+                (err = snd_pcm_sw_params_set_avail_min(s.pcm, sw, s.period)) < 0 ||
+                (err = snd_pcm_sw_params_get_boundary(sw, &boundary)) < 0 ||
+                (err = snd_pcm_sw_params_set_start_threshold(s.pcm, sw, boundary)) < 0 ||
+                (err = snd_pcm_sw_params(s.pcm, sw)) < 0)
+                what = "sw params";
+        }
+        if (what != nullptr)
+        {
+            printf("ERROR: Can't set %s of %s (%s)\n", what, s.name.c_str(), snd_strerror(err));
+            snd_pcm_close(s.pcm);
+            s.pcm = nullptr;
+            return err;
+        }
+        s.first_fd = fds_.size();
+        s.nfds = snd_pcm_poll_descriptors_count(s.pcm);
+        fds_.resize(fds_.size() + s.nfds);
+        snd_pcm_poll_descriptors(s.pcm, &fds_[s.first_fd], s.nfds);
+        dev.latency_ms = SoundDev::LatencyMs(s.period, s.buffer / s.period, dev.sample_rate);
+        return 0;
+    }
+
+    // Hands every frame the device has ready, or room for, to the callbacks, in place
+    int Transfer(Stream &s)
+    {
+        snd_pcm_sframes_t avail = snd_pcm_avail_update(s.pcm);
+        if (avail < 0)
+            return avail;
+        snd_pcm_uframes_t frames = avail;
+        while (frames > 0)
+        {
+            const snd_pcm_channel_area_t *areas;
+            snd_pcm_uframes_t offset, n = frames;
+            int err = snd_pcm_mmap_begin(s.pcm, &areas, &offset, &n);
+            if (err < 0)
+                return err;
+            if (n == 0)
+                break;
+            uint8_t *p = (uint8_t *)areas[0].addr + areas[0].first / 8 + offset * (areas[0].step / 8);
+            if (s.dir == SND_PCM_STREAM_PLAYBACK)
+            {
+                snd_pcm_format_set_silence(s.format, p, n * s.dev->channels);
+                s.dev->Dispatch(p, nullptr, n);
+            }
+            else
+            {
+                s.dev->Dispatch(nullptr, p, n);
+            }
+            // A short commit is not an xrun: commit the rest
+            for (snd_pcm_uframes_t committed = 0; committed < n;)
+            {
+                snd_pcm_sframes_t done = snd_pcm_mmap_commit(s.pcm, offset + committed, n - committed);
+                if (done < 0)
+                    return done;
+                if (done == 0)
+                    return -EIO;
+                committed += done;
+            }
+            frames -= n;
+        }
+        return 0;
+    }
+
+    // Fills the playback buffer and starts; linked streams start together
+    int Start(Stream &s)
+    {
+        int err;
+        if (&s == &streams_[0] || linked_)
+        {
+            if ((err = Transfer(streams_[0])) < 0)
+                return err;
+        }
+        return snd_pcm_start(s.pcm);
+    }
+
+    // Restarts s after err, retrying with backoff; returns the last error when it gives up
+    int Recover(Stream &s, int err)
+    {
+        xruns[&s - streams_].fetch_add(1, std::memory_order_relaxed);
+        for (int attempt = 0; attempt <= MaxRetries && running_.load(std::memory_order_acquire); attempt++)
+        {
+            if (attempt > 0)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10 << (attempt - 1)));
+                err = snd_pcm_prepare(s.pcm);
+            }
+            else
+            {
+                err = snd_pcm_recover(s.pcm, err, 1);
+            }
+            if (err >= 0 && linked_)
+                err = snd_pcm_prepare(streams_[0].pcm);
+            if (err >= 0 && (err = Start(s)) >= 0)
+                return 0;
+        }
+        printf("ERROR: Can't restart %s (%s)\n", s.name.c_str(), snd_strerror(err));
+        return err;
+    }
+
+    void Run()
+    {
+        while (running_.load(std::memory_order_acquire))
+        {
+            if (poll(fds_.data(), fds_.size(), 1000) < 0)
+            {
+                int err = errno;
+                if (err == EINTR)
+                    continue;
+                printf("ERROR: poll on PCM devices failed (%s)\n", strerror(err));
+                Fail(-err);
+                return;
+            }
+            if (fds_.back().revents)
+                break;
+            for (Stream &s : streams_)
+            {
+                unsigned short revents = 0;
+                snd_pcm_poll_descriptors_revents(s.pcm, &fds_[s.first_fd], s.nfds, &revents);
+                if (!(revents & (POLLIN | POLLOUT | POLLERR)))
+                    continue;
+                int err = Transfer(s);
+                if (err < 0 && (err = Recover(s, err)) < 0 && running_.load(std::memory_order_acquire))
+                {
+                    Fail(err);
+                    return;
+                }
+            }
+        }
+    }
+
+    void Fail(int err)
+    {
+        running_.store(false, std::memory_order_release);
+        error_.store(err < 0 ? err : -EIO, std::memory_order_release);
+        if (on_failure)
+            on_failure(error_.load());
+    }
+
+    void CloseStreams()
+    {
+        if (linked_)
+        {
+            snd_pcm_unlink(streams_[1].pcm);
+            linked_ = false;
+        }
+        for (Stream &s : streams_)
+        {
+            if (s.pcm)
+            {
+                snd_pcm_drop(s.pcm);
+                snd_pcm_close(s.pcm);
+                s.pcm = nullptr;
+            }
+        }
+        fds_.clear();
+        if (stop_fd_ >= 0)
+        {
+            close(stop_fd_);
+            stop_fd_ = -1;
+        }
+    }
+
+public:
+    std::atomic<uint64_t> xruns[2]; // playback, capture
+    double open_ms = 0;             // time Open() took
+    // Called once from the ALSA thread when it gives up; must not call Close()
+    std::function<void(int err)> on_failure;
+
+    AlsaMmapDev(PlayDev &play, RecordDev &record, const std::string &play_name = "default", const std::string &record_name = "default")
+        : play_(play), record_(record), running_(false), error_(0)
+    {
+        streams_[0] = {&play, SND_PCM_STREAM_PLAYBACK, play_name, nullptr, SND_PCM_FORMAT_UNKNOWN, 0, 0, 0, 0};
+        streams_[1] = {&record, SND_PCM_STREAM_CAPTURE, record_name, nullptr, SND_PCM_FORMAT_UNKNOWN, 0, 0, 0, 0};
+        xruns[0].store(0);
+        xruns[1].store(0);
+    }
+    AlsaMmapDev(const AlsaMmapDev &) = delete;
+    AlsaMmapDev &operator=(const AlsaMmapDev &) = delete;
+    ~AlsaMmapDev()
+    {
+        Close();
+    }
+
+    int Open()
+    {
+        auto start = std::chrono::steady_clock::now();
+        if (Setup(streams_[0]) < 0 || Setup(streams_[1]) < 0)
+        {
+            CloseStreams();
+            return -1;
+        }
+        stop_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        fds_.push_back({stop_fd_, POLLIN, 0});
+        linked_ = snd_pcm_link(streams_[1].pcm, streams_[0].pcm) == 0;
+
+        play_.AddCb(PlayDev::PlayCb, &play_, "mixer");
+        int err;
+        if ((err = Start(streams_[0])) < 0 || (!linked_ && (err = Start(streams_[1])) < 0))
+        {
+            printf("ERROR: Can't start PCM devices (%s)\n", snd_strerror(err));
+            play_.RemoveCb(PlayDev::PlayCb);
+            CloseStreams();
+            return -1;
+        }
+        error_.store(0);
+        running_.store(true, std::memory_order_release);
+        thread_ = std::thread(&AlsaMmapDev::Run, this);
+        SoundDev::TuneThread(thread_.native_handle(), play_.tuning);
+        for (Stream &s : streams_)
+        {
+            s.dev->report = SoundDev::Describe(linked_ ? "ALSA mmap, linked" : "ALSA mmap", thread_.native_handle(),
+                                               s.period, s.buffer / s.period, s.dev->sample_rate, true);
+        }
+        open_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return 0;
+    }
+
+    // True once the thread stopped on an error it couldn't recover from; error() says which
+    bool failed() const
+    {
+        return error_.load(std::memory_order_acquire) != 0;
+    }
+    int error() const
+    {
+        return error_.load(std::memory_order_acquire);
+    }
+
+    int Close()
+    {
+        if (thread_.joinable())
+        {
+            running_.store(false, std::memory_order_release);
+            uint64_t one = 1;
+            ssize_t ret = write(stop_fd_, &one, sizeof(one));
+            (void)ret;
+            thread_.join();
+            play_.RemoveCb(PlayDev::PlayCb);
+        }
+        CloseStreams();
+        return 0;
+    }
+};
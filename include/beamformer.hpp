@@ -0,0 +1,397 @@
+#pragma once
+#include <stdint.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+#include "sound.hpp"
+#include "resampler.hpp"
+
+struct MicPosition
+{
+    float x; // metres, towards the robot's front
+    float y; // metres, towards its left
+};
+
+struct BeamformerConfig
+{
+    bool enabled = true;
+    int channel = 3;               // mic used when not beamforming, the legacy capture used the fourth
+    std::vector<MicPosition> mics; // one per capture channel, in channel order; empty means use channel
+    float azimuth_deg = 0;         // look direction, counter-clockwise from the front
+    bool track = true;             // steer to the loudest of directions azimuths while nothing plays
+    int directions = 8;
+    float cpu_budget = 0.05f;      // share of one core; above it tracking stops, then channel is used
+};
+
+// Far-field delay-and-sum beamformer for the capture array: deinterleaves every mic into planar
+// float, aligns them on the look direction with fractional-delay filters and averages them into
+// one channel. Optionally steers to the loudest direction. Falls back to a single mic when the
+// geometry does not match the device or the work does not fit cpu_budget. Single-threaded: call
+// Process() from the thread that reads the capture ring.
+class Beamformer
+{
+public:
+    static const int Taps = 16; // fractional-delay filter length, a multiple of 4
+
+    enum Mode
+    {
+        Select,      // pass one mic through
+        DelayAndSum,
+    };
+
+private:
+    struct Steering
+    {
+        float azimuth;
+        std::vector<float> h; // per mic: Taps coefficients, reversed to run forward over the input
+        std::vector<int> lag; // per mic: whole-sample part of the delay
+    };
+
+    BeamformerConfig config_;
+    int sample_rate_;
+    ma_format format_;
+    int channels_;
+    Mode mode_ = Select;
+    bool tracking_ = false;
+    bool frozen_ = false;
+    int history_ = Taps - 1;            // samples kept in front of the new input of each channel
+    std::vector<std::vector<float>> x_; // per channel: history_ samples, then the new input
+    std::vector<Steering> steer_;       // candidate look directions, the configured one first
+    int look_ = 0;
+    std::vector<float> power_;          // per candidate: smoothed output power, for tracking
+    std::vector<float> y_;              // beam output
+    std::vector<float> probe_;          // output of the other directions while scanning
+    size_t since_scan_ = 0;             // frames since the directions were last compared
+    double window_us_ = 0, window_s_ = 0;
+    int over_budget_ = 0;               // consecutive seconds over cpu_budget
+
+    Steering Steer(float azimuth) const
+    {
+        const float c = 343.0f; // speed of sound, m/s
+        const int M = channels_;
+        Steering s;
+        s.azimuth = azimuth;
+        s.h.resize(M * Taps);
+        s.lag.resize(M);
+        // A mic further along the look direction hears the wave earlier and is delayed more
+        std::vector<float> lead(M);
+        for (int m = 0; m < M; m++)
+            lead[m] = (config_.mics[m].x * cosf(azimuth) + config_.mics[m].y * sinf(azimuth)) / c * sample_rate_;
+        float first = *std::min_element(lead.begin(), lead.end());
+        for (int m = 0; m < M; m++)
+        {
+            float delay = lead[m] - first;
+            s.lag[m] = (int)floorf(delay);
+            float frac = delay - s.lag[m];
+            // Blackman-windowed sinc centred at Taps / 2 - 1 + frac, unity gain at DC
+            float sum = 0;
+            float *h = &s.h[m * Taps];
+            for (int k = 0; k < Taps; k++)
+            {
+                double t = k - (Taps / 2 - 1) - frac;
+                double sinc = t == 0 ? 1 : sin(M_PI * t) / (M_PI * t);
+                double window = 0.42 + 0.5 * cos(2 * M_PI * t / Taps) + 0.08 * cos(4 * M_PI * t / Taps);
+                h[Taps - 1 - k] = (float)(sinc * window);
+                sum += h[Taps - 1 - k];
+            }
+            for (int k = 0; k < Taps; k++)
+                h[k] /= sum * M;
+        }
+        return s;
+    }
+
+    // Interleaved capture to planar float behind the history of each channel
+    void Deinterleave(const uint8_t *in, size_t frames)
+    {
+        for (int c = 0; c < channels_; c++)
+            x_[c].resize(history_ + frames);
+        size_t i = 0;
+        if (channels_ == 4)
+        {
+            float *a = x_[0].data() + history_, *b = x_[1].data() + history_;
+            float *c = x_[2].data() + history_, *d = x_[3].data() + history_;
+            if (format_ == ma_format_s16)
+            {
+                const int16_t *src = (const int16_t *)in;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+                const float32x4_t scale = vdupq_n_f32(1.0f / 32768.0f);
+                for (; i + 8 <= frames; i += 8)
+                {
+                    int16x8x4_t v = vld4q_s16(src + i * 4);
+                    float *dst[4] = {a + i, b + i, c + i, d + i};
+                    for (int ch = 0; ch < 4; ch++)
+                    {
+                        vst1q_f32(dst[ch], vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v.val[ch]))), scale));
+                        vst1q_f32(dst[ch] + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v.val[ch]))), scale));
+                    }
+                }
+#elif defined(__SSE2__)
+                const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+                for (; i + 8 <= frames; i += 8)
+                {
+                    // 8 frames of a b c d: transpose 16-bit lanes into one register per mic
+                    const __m128i *p = (const __m128i *)(src + i * 4);
+                    __m128i r0 = _mm_loadu_si128(p), r1 = _mm_loadu_si128(p + 1);
+                    __m128i r2 = _mm_loadu_si128(p + 2), r3 = _mm_loadu_si128(p + 3);
+                    __m128i t0 = _mm_unpacklo_epi16(r0, r1), t1 = _mm_unpackhi_epi16(r0, r1);
+                    __m128i t2 = _mm_unpacklo_epi16(r2, r3), t3 = _mm_unpackhi_epi16(r2, r3);
+                    __m128i u0 = _mm_unpacklo_epi16(t0, t1), u1 = _mm_unpackhi_epi16(t0, t1);
+                    __m128i u2 = _mm_unpacklo_epi16(t2, t3), u3 = _mm_unpackhi_epi16(t2, t3);
+                    __m128i v[4] = {_mm_unpacklo_epi64(u0, u2), _mm_unpackhi_epi64(u0, u2),
+                                    _mm_unpacklo_epi64(u1, u3), _mm_unpackhi_epi64(u1, u3)};
+                    float *dst[4] = {a + i, b + i, c + i, d + i};
+                    for (int ch = 0; ch < 4; ch++)
+                    {
+                        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v[ch], v[ch]), 16);
+                        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v[ch], v[ch]), 16);
+                        _mm_storeu_ps(dst[ch], _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+                        _mm_storeu_ps(dst[ch] + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+                    }
+                }
+#endif
+            }
+            else if (format_ == ma_format_f32)
+            {
+                const float *src = (const float *)in;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+                for (; i + 4 <= frames; i += 4)
+                {
+                    float32x4x4_t v = vld4q_f32(src + i * 4);
+                    vst1q_f32(a + i, v.val[0]);
+                    vst1q_f32(b + i, v.val[1]);
+                    vst1q_f32(c + i, v.val[2]);
+                    vst1q_f32(d + i, v.val[3]);
+                }
+#elif defined(__SSE2__)
+                for (; i + 4 <= frames; i += 4)
+                {
+                    __m128 r0 = _mm_loadu_ps(src + i * 4), r1 = _mm_loadu_ps(src + i * 4 + 4);
+                    __m128 r2 = _mm_loadu_ps(src + i * 4 + 8), r3 = _mm_loadu_ps(src + i * 4 + 12);
+                    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+                    _mm_storeu_ps(a + i, r0);
+                    _mm_storeu_ps(b + i, r1);
+                    _mm_storeu_ps(c + i, r2);
+                    _mm_storeu_ps(d + i, r3);
+                }
+#endif
+            }
+        }
+        for (int c = 0; c < channels_; c++)
+        {
+            float *dst = x_[c].data() + history_;
+            for (size_t j = i; j < frames; j++)
+                dst[j] = format_ == ma_format_f32 ? ((const float *)in)[j * channels_ + c]
+                                                  : ((const int16_t *)in)[j * channels_ + c] * (1.0f / 32768.0f);
+        }
+    }
+
+    // Beam output of steering s over the new input
+    void Sum(const Steering &s, size_t frames, float *y) const
+    {
+        std::fill(y, y + frames, 0.0f);
+        for (int m = 0; m < channels_; m++)
+        {
+            const float *h = &s.h[m * Taps];
+            const float *x = x_[m].data() + history_ - s.lag[m] - (Taps - 1);
+            for (size_t i = 0; i < frames; i++)
+                y[i] += DotF32(h, x + i, Taps);
+        }
+    }
+
+    // Power of the first difference: low-frequency rumble, which a small array cannot steer
+    // against, does not decide the direction
+    static float Power(const float *y, size_t frames)
+    {
+        float p = 0;
+        for (size_t i = 1; i < frames; i++)
+            p += (y[i] - y[i - 1]) * (y[i] - y[i - 1]);
+        return p;
+    }
+
+    // Compares every direction on the current input and moves to the loudest if it is
+    // clearly louder than the one in use
+    void Scan(size_t frames)
+    {
+        probe_.resize(frames);
+        for (size_t d = 0; d < steer_.size(); d++)
+        {
+            float p;
+            if ((int)d == look_)
+                p = Power(y_.data(), frames);
+            else
+            {
+                Sum(steer_[d], frames, probe_.data());
+                p = Power(probe_.data(), frames);
+            }
+            power_[d] += (p - power_[d]) * 0.3f;
+        }
+        int best = (int)(std::max_element(power_.begin(), power_.end()) - power_.begin());
+        if (best != look_ && power_[best] > power_[look_] * 1.26f) // 1 dB
+        {
+            look_ = best;
+            switches++;
+        }
+    }
+
+    void Store(uint8_t *out, size_t frames) const
+    {
+        for (size_t i = 0; i < frames; i++)
+        {
+            if (format_ == ma_format_f32)
+                ((float *)out)[i] = y_[i];
+            else
+            {
+                float y = y_[i] * 32768.0f;
+                ((int16_t *)out)[i] = (int16_t)(y >= 32767.0f ? 32767 : y <= -32768.0f ? -32768 : lrintf(y));
+            }
+        }
+    }
+
+    // Called once per second of audio: a second over budget stops tracking, the next second
+    // still over budget drops to the single mic
+    void CheckBudget()
+    {
+        cpu_share = window_us_ / (window_s_ * 1e6);
+        window_us_ = window_s_ = 0;
+        over_budget_ = cpu_share > config_.cpu_budget ? over_budget_ + 1 : 0;
+        if (over_budget_ == 0 || mode_ != DelayAndSum)
+            return;
+        if (tracking_)
+            tracking_ = false;
+        else
+            mode_ = Select;
+        fallbacks++;
+    }
+
+public:
+    // Statistics since the last ResetStats()
+    uint64_t switches = 0;  // look direction changes
+    uint64_t fallbacks = 0; // steps down for the CPU budget, never reset
+    double cpu_share = 0;   // share of one core over the last second
+    double cpu_us = 0;      // time spent in Process()
+    double audio_s = 0;     // capture audio processed
+
+    Beamformer(int sample_rate, int format, int channels)
+        : sample_rate_(sample_rate), format_((ma_format)format), channels_(channels)
+    {
+        Configure(config_);
+    }
+
+    void Configure(const BeamformerConfig &config)
+    {
+        config_ = config;
+        config_.channel = std::min(std::max(config.channel, 0), channels_ - 1);
+        bool array = config.enabled && channels_ > 1 && (int)config.mics.size() == channels_ &&
+                     (format_ == ma_format_s16 || format_ == ma_format_f32);
+        mode_ = array ? DelayAndSum : Select;
+        steer_.clear();
+        power_.clear();
+        look_ = 0;
+        history_ = Taps - 1;
+        if (mode_ == DelayAndSum)
+        {
+            int n = config.track ? std::max(config.directions, 1) : 1;
+            for (int d = 0; d < n; d++)
+            {
+                steer_.push_back(Steer((float)((config.azimuth_deg + 360.0 * d / n) * M_PI / 180)));
+                int lag = *std::max_element(steer_.back().lag.begin(), steer_.back().lag.end());
+                history_ = std::max(history_, Taps - 1 + lag);
+            }
+            power_.assign(n, 0.0f);
+        }
+        tracking_ = steer_.size() > 1;
+        x_.assign(channels_, std::vector<float>(history_, 0.0f));
+        since_scan_ = 0;
+        window_us_ = window_s_ = 0;
+        over_budget_ = 0;
+    }
+
+    const BeamformerConfig &config() const
+    {
+        return config_;
+    }
+
+    Mode mode() const
+    {
+        return mode_;
+    }
+
+    bool tracking() const
+    {
+        return tracking_;
+    }
+
+    const char *ModeName() const
+    {
+        return mode_ == DelayAndSum ? (tracking_ ? "delay-and-sum, tracking" : "delay-and-sum") : "single mic";
+    }
+
+    // Look direction in degrees, counter-clockwise from the front, in 0..360
+    float azimuth_deg() const
+    {
+        if (mode_ != DelayAndSum)
+            return 0;
+        float deg = fmodf(steer_[look_].azimuth * 180 / (float)M_PI, 360);
+        return deg < 0 ? deg + 360 : deg;
+    }
+
+    // Holds the look direction, e.g. while playing: the loudest source is then our own speaker
+    void Freeze(bool frozen)
+    {
+        frozen_ = frozen;
+    }
+
+    void ResetStats()
+    {
+        switches = 0;
+        cpu_us = audio_s = 0;
+    }
+
+    // Output bytes for size bytes of capture: one channel of the capture format
+    size_t OutputBytes(size_t size) const
+    {
+        return size / channels_;
+    }
+
+    // Mixes size bytes of interleaved capture down to one channel in out. Returns the bytes written.
+    size_t Process(const uint8_t *in, size_t size, uint8_t *out)
+    {
+        auto start = std::chrono::steady_clock::now();
+        size_t bps = ma_get_bytes_per_sample(format_);
+        size_t frames = size / (bps * channels_);
+        if (mode_ == Select)
+        {
+            if (channels_ == 1)
+                memcpy(out, in, frames * bps);
+            else
+                for (size_t i = 0; i < frames; i++)
+                    memcpy(out + i * bps, in + (i * channels_ + config_.channel) * bps, bps);
+        }
+        else
+        {
+            Deinterleave(in, frames);
+            y_.resize(frames);
+            Sum(steer_[look_], frames, y_.data());
+            since_scan_ += frames;
+            if (tracking_ && !frozen_ && since_scan_ >= (size_t)sample_rate_ / 5)
+            {
+                Scan(frames);
+                since_scan_ = 0;
+            }
+            Store(out, frames);
+            for (int c = 0; c < channels_; c++)
+                std::copy(x_[c].end() - history_, x_[c].end(), x_[c].begin());
+        }
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        double s = (double)frames / sample_rate_;
+        cpu_us += us;
+        audio_s += s;
+        window_us_ += us;
+        window_s_ += s;
+        if (window_s_ >= 1)
+            CheckBudget();
+        return frames * bps;
+    }
+};
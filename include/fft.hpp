@@ -0,0 +1,69 @@
+#pragma once
+#include <math.h>
+#include <complex>
+#include <vector>
+#include <algorithm>
+
+// In-place radix-2 complex FFT of a fixed power-of-two size
+class Fft
+{
+private:
+    int n_;
+    std::vector<std::complex<float>> twiddle_;
+    std::vector<int> bitrev_;
+
+    void Transform(std::complex<float> *x, bool inverse) const
+    {
+        for (int i = 0; i < n_; i++)
+            if (i < bitrev_[i])
+                std::swap(x[i], x[bitrev_[i]]);
+        for (int len = 2; len <= n_; len <<= 1)
+        {
+            int step = n_ / len;
+            for (int i = 0; i < n_; i += len)
+                for (int j = 0; j < len / 2; j++)
+                {
+                    std::complex<float> w = inverse ? std::conj(twiddle_[j * step]) : twiddle_[j * step];
+                    std::complex<float> u = x[i + j], v = x[i + j + len / 2] * w;
+                    x[i + j] = u + v;
+                    x[i + j + len / 2] = u - v;
+                }
+        }
+    }
+
+public:
+    explicit Fft(int n) : n_(n), twiddle_(n / 2), bitrev_(n)
+    {
+        int bits = 0;
+        while ((1 << bits) < n)
+            bits++;
+        for (int i = 0; i < n; i++)
+        {
+            int r = 0;
+            for (int b = 0; b < bits; b++)
+                r |= ((i >> b) & 1) << (bits - 1 - b);
+            bitrev_[i] = r;
+        }
+        for (int i = 0; i < n / 2; i++)
+            twiddle_[i] = std::polar(1.0f, (float)(-2 * M_PI * i / n));
+    }
+
+    int size() const
+    {
+        return n_;
+    }
+
+    void Forward(std::complex<float> *x) const
+    {
+        Transform(x, false);
+    }
+
+    // Inverse transform, scaled by 1/n so that Inverse(Forward(x)) == x
+    void Inverse(std::complex<float> *x) const
+    {
+        Transform(x, true);
+        float scale = 1.0f / n_;
+        for (int i = 0; i < n_; i++)
+            x[i] *= scale;
+    }
+};
@@ -0,0 +1,347 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <cmath>
+#include <array>
+#include <chrono>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "sound.hpp"
+#include "fft.hpp"
+
+// MFCC front end: 25 ms Hamming frames every 10 ms, 23 mel bands, cepstra 1..12 (c0 is left
+// out so matching does not depend on level).
+class Mfcc
+{
+public:
+    static const int Bands = 23;
+    static const int Coeffs = 12;
+    using Frame = std::array<float, Coeffs>;
+
+private:
+    int frame_len_;
+    int hop_;
+    int fft_size_;
+    Fft fft_;
+    std::vector<float> window_;
+    std::vector<std::vector<std::pair<int, float>>> mel_; // per band: (bin, weight)
+    float dct_[Coeffs][Bands];
+    std::vector<float> history_; // samples not yet consumed by a frame
+    std::vector<std::complex<float>> spectrum_;
+
+    static int FftSize(int frame_len)
+    {
+        int n = 1;
+        while (n < frame_len)
+            n <<= 1;
+        return n;
+    }
+
+    static float Mel(float hz)
+    {
+        return 2595.0f * log10f(1.0f + hz / 700.0f);
+    }
+
+public:
+    explicit Mfcc(int sample_rate)
+        : frame_len_(sample_rate / 40), hop_(sample_rate / 100), fft_size_(FftSize(frame_len_)), fft_(fft_size_)
+    {
+        window_.resize(frame_len_);
+        for (int i = 0; i < frame_len_; i++)
+            window_[i] = 0.54f - 0.46f * cosf(2 * M_PI * i / (frame_len_ - 1));
+
+        // Triangular mel filters from 100 Hz to Nyquist
+        float lo = Mel(100), hi = Mel(sample_rate / 2.0f);
+        std::vector<float> edges(Bands + 2);
+        for (int b = 0; b < Bands + 2; b++)
+        {
+            float mel = lo + (hi - lo) * b / (Bands + 1);
+            edges[b] = 700.0f * (powf(10.0f, mel / 2595.0f) - 1.0f) * fft_size_ / sample_rate;
+        }
+        mel_.resize(Bands);
+        for (int b = 0; b < Bands; b++)
+            for (int k = (int)ceilf(edges[b]); k <= (int)edges[b + 2] && k <= fft_size_ / 2; k++)
+            {
+                float w = k < edges[b + 1] ? (k - edges[b]) / (edges[b + 1] - edges[b]) : (edges[b + 2] - k) / (edges[b + 2] - edges[b + 1]);
+                if (w > 0)
+                    mel_[b].push_back(std::make_pair(k, w));
+            }
+        for (int c = 0; c < Coeffs; c++)
+            for (int b = 0; b < Bands; b++)
+                dct_[c][b] = sqrtf(2.0f / Bands) * cosf(M_PI * (c + 1) * (b + 0.5f) / Bands);
+        spectrum_.resize(fft_size_);
+        history_.reserve(frame_len_ + hop_);
+    }
+
+    // Feeds mono samples and calls on_frame(const Frame &) every 10 ms
+    template <class F>
+    void Process(const float *x, size_t n, F on_frame)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            history_.push_back(x[i]);
+            if ((int)history_.size() < frame_len_)
+                continue;
+            for (int k = 0; k < fft_size_; k++)
+                spectrum_[k] = k < frame_len_ ? history_[k] * window_[k] : 0.0f;
+            fft_.Forward(spectrum_.data());
+            float energies[Bands];
+            for (int b = 0; b < Bands; b++)
+            {
+                float e = 1e-5f; // about -50 dBFS, keeps quiet bands from dominating
+                for (auto &bw : mel_[b])
+                    e += std::norm(spectrum_[bw.first]) * bw.second;
+                energies[b] = logf(e);
+            }
+            Frame frame;
+            for (int c = 0; c < Coeffs; c++)
+            {
+                float sum = 0;
+                for (int b = 0; b < Bands; b++)
+                    sum += dct_[c][b] * energies[b];
+                frame[c] = sum;
+            }
+            on_frame(frame);
+            history_.erase(history_.begin(), history_.begin() + hop_);
+        }
+    }
+};
+
+struct KwsConfig
+{
+    bool enabled = false;
+    float threshold = 2.5f;  // mean per-frame MFCC distance that counts as a match
+    int refractory_ms = 1000; // no new detection this soon after the last one
+};
+
+// Keyword spotter matching enrolled recordings of the wake word against the capture stream
+// with streaming subsequence DTW: one DTW column per template is updated every 10 ms, so
+// the cost is a few hundred distance computations per frame. Single-threaded.
+class KeywordSpotter
+{
+private:
+    struct Template
+    {
+        std::vector<Mfcc::Frame> frames;
+        std::vector<float> cost; // DTW column: best accumulated distance ending at each template frame
+        std::vector<int> steps;  // weight of that path, the score divides the cost by it
+    };
+
+    KwsConfig config_;
+    int sample_rate_;
+    ma_format format_;
+    int channels_;
+    Mfcc mfcc_;
+    std::vector<Template> templates_;
+    int refractory_frames_ = 0;
+    bool detected_ = false;
+    std::vector<float> samples_;
+
+    static float Distance(const Mfcc::Frame &a, const Mfcc::Frame &b)
+    {
+        float sum = 0;
+        for (int c = 0; c < Mfcc::Coeffs; c++)
+            sum += (a[c] - b[c]) * (a[c] - b[c]);
+        return sqrtf(sum);
+    }
+
+    void Reset(Template &t)
+    {
+        std::fill(t.cost.begin(), t.cost.end(), std::numeric_limits<float>::infinity());
+        std::fill(t.steps.begin(), t.steps.end(), 0);
+    }
+
+    void OnFrame(const Mfcc::Frame &frame)
+    {
+        if (refractory_frames_ > 0)
+            refractory_frames_--;
+
+        for (auto &t : templates_)
+        {
+            // Every step consumes one input frame and advances the template by 0, 1 or 2 frames.
+            // A skip is charged twice so it cannot undercut matching every frame, and a match
+            // may start at any input frame.
+            size_t m = t.frames.size();
+            for (size_t i = m; i-- > 0;)
+            {
+                float d = Distance(t.frames[i], frame);
+                float cost = i == 0 ? d : t.cost[i] + d;
+                int weight = i == 0 ? 1 : t.steps[i] + 1;
+                if (i >= 1 && t.cost[i - 1] + d < cost)
+                {
+                    cost = t.cost[i - 1] + d;
+                    weight = t.steps[i - 1] + 1;
+                }
+                if (i >= 2 && t.cost[i - 2] + 2 * d < cost)
+                {
+                    cost = t.cost[i - 2] + 2 * d;
+                    weight = t.steps[i - 2] + 2;
+                }
+                t.cost[i] = cost;
+                t.steps[i] = weight;
+            }
+            // Only paths between half and full template speed count as a whole keyword
+            if (t.steps[m - 1] == 0 || t.steps[m - 1] > (int)(2 * m))
+                continue;
+            float score = t.cost[m - 1] / t.steps[m - 1];
+            last_score = std::min(last_score, score);
+            if (refractory_frames_ == 0 && score < config_.threshold)
+            {
+                detected_ = true;
+                detections++;
+                refractory_frames_ = config_.refractory_ms / 10;
+                for (auto &other : templates_)
+                    Reset(other);
+                break;
+            }
+        }
+    }
+
+    void ToMono(const uint8_t *data, size_t size)
+    {
+        size_t frames = size / ma_get_bytes_per_frame(format_, channels_);
+        samples_.resize(frames);
+        for (size_t i = 0; i < frames; i++)
+            samples_[i] = format_ == ma_format_f32 ? ((const float *)data)[i * channels_]
+                                                   : ((const int16_t *)data)[i * channels_] * (1.0f / 32768.0f);
+    }
+
+public:
+    uint64_t detections = 0;
+    double cpu_us = 0;  // time spent in Process(), since the last ResetStats()
+    double audio_s = 0; // capture audio processed, since the last ResetStats()
+    float last_score = std::numeric_limits<float>::infinity(); // best score since the last Process()
+
+    KeywordSpotter(int sample_rate, int format, int channels)
+        : sample_rate_(sample_rate), format_((ma_format)format), channels_(channels), mfcc_(sample_rate) {}
+
+    void Configure(const KwsConfig &config)
+    {
+        config_ = config;
+    }
+
+    const KwsConfig &config() const
+    {
+        return config_;
+    }
+
+    bool enabled() const
+    {
+        return config_.enabled && !templates_.empty();
+    }
+
+    size_t templates() const
+    {
+        return templates_.size();
+    }
+
+    void ResetStats()
+    {
+        cpu_us = audio_s = 0;
+    }
+
+    // Enrolls one recording of the keyword, in the capture format. Leading and trailing
+    // frames more than 30 dB below the loudest are trimmed.
+    bool AddTemplate(const uint8_t *data, size_t size)
+    {
+        ToMono(data, size);
+        Mfcc mfcc(sample_rate_);
+        std::vector<Mfcc::Frame> frames;
+        std::vector<float> level;
+        int hop = sample_rate_ / 100;
+        mfcc.Process(samples_.data(), samples_.size(), [&](const Mfcc::Frame &f) { frames.push_back(f); });
+        for (size_t i = 0; i < frames.size(); i++)
+        {
+            double e = 1e-10;
+            for (int k = 0; k < hop && (i * hop + k) < samples_.size(); k++)
+                e += samples_[i * hop + k] * samples_[i * hop + k];
+            level.push_back(10 * log10f((float)e));
+        }
+        if (frames.size() < 10)
+            return false;
+        float peak = *std::max_element(level.begin(), level.end());
+        size_t begin = 0, end = frames.size();
+        while (begin < end && level[begin] < peak - 30)
+            begin++;
+        while (end > begin && level[end - 1] < peak - 30)
+            end--;
+        if (end - begin < 10)
+            return false;
+
+        Template t;
+        t.frames.assign(frames.begin() + begin, frames.begin() + end);
+        t.cost.resize(t.frames.size());
+        t.steps.resize(t.frames.size());
+        Reset(t);
+        templates_.push_back(t);
+        return true;
+    }
+
+    // Enrolls a 16-bit PCM WAV file, converting it to the capture format and rate.
+    bool LoadTemplate(const std::string &path)
+    {
+        std::ifstream ifs(path, std::ios::binary);
+        std::vector<char> wav((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+        if (wav.size() < 12 || memcmp(wav.data(), "RIFF", 4) != 0 || memcmp(wav.data() + 8, "WAVE", 4) != 0)
+            return false;
+        int rate = 0, channels = 0, bits = 0;
+        for (size_t pos = 12; pos + 8 <= wav.size();)
+        {
+            uint32_t len;
+            memcpy(&len, wav.data() + pos + 4, 4);
+            const char *body = wav.data() + pos + 8;
+            if (memcmp(wav.data() + pos, "fmt ", 4) == 0)
+            {
+                if (len < 16 || pos + 8 + len > wav.size())
+                    return false;
+                uint16_t ch, bps;
+                uint32_t sr;
+                memcpy(&ch, body + 2, 2);
+                memcpy(&sr, body + 4, 4);
+                memcpy(&bps, body + 14, 2);
+                channels = ch;
+                rate = sr;
+                bits = bps;
+            }
+            else if (memcmp(wav.data() + pos, "data", 4) == 0 && bits == 16)
+            {
+                if (rate <= 0 || rate > ma_standard_sample_rate_max || channels <= 0 || channels > MA_MAX_CHANNELS)
+                    return false;
+                len = std::min<uint32_t>(len, wav.size() - pos - 8);
+                std::vector<uint8_t> pcm;
+                try
+                {
+                    PcmConverter converter(ma_format_s16, rate, channels, format_, sample_rate_, channels_);
+                    pcm = converter.Convert(body, len);
+                }
+                catch (const std::exception &)
+                {
+                    return false;
+                }
+                return AddTemplate(pcm.data(), pcm.size());
+            }
+            pos += 8 + len + (len & 1);
+        }
+        return false;
+    }
+
+    // Feeds captured audio, returns true if the keyword was spotted in it.
+    bool Process(const uint8_t *data, size_t size)
+    {
+        detected_ = false;
+        last_score = std::numeric_limits<float>::infinity();
+        if (templates_.empty())
+            return false;
+        auto start = std::chrono::steady_clock::now();
+        ToMono(data, size);
+        mfcc_.Process(samples_.data(), samples_.size(), [this](const Mfcc::Frame &f) { OnFrame(f); });
+        cpu_us += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        audio_s += (double)samples_.size() / sample_rate_;
+        return detected_;
+    }
+};
@@ -0,0 +1,163 @@
+#pragma once
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include <miniaudio.h>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Streaming resampler used by PcmConverter in place of ma_data_converter when a fast path exists.
+class Resampler
+{
+public:
+    virtual ~Resampler() {}
+    // Converts up to *inFrames frames into at most *outFrames frames, keeping filter state
+    // across calls. On return both hold the frames actually consumed and produced.
+    virtual void Process(const void *in, ma_uint64 *inFrames, void *out, ma_uint64 *outFrames) = 0;
+};
+
+// Sum of a[i] * b[i], n a multiple of 4
+inline float DotF32(const float *a, const float *b, int n)
+{
+    int i = 0;
+    float sum = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    float32x4_t acc = vdupq_n_f32(0);
+    for (; i + 4 <= n; i += 4)
+        acc = vmlaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+    float32x2_t half = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    sum = vget_lane_f32(vpadd_f32(half, half), 0);
+#elif defined(__SSE2__)
+    __m128 acc = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4)
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    sum = _mm_cvtss_f32(acc);
+#endif
+    for (; i < n; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+// Polyphase resampler for out_rate / in_rate = L / M, with a windowed-sinc prototype filter
+// of K taps per phase. Input is f32 or s16, converted on load; output is f32 or s16,
+// converted and saturated on store, so the format change costs no extra pass.
+template <int L, int M>
+class PolyphaseResampler : public Resampler
+{
+public:
+    static const int K = M > L ? 16 * M : 16; // taps per phase, a multiple of 4
+
+private:
+    ma_format inFormat;
+    ma_format outFormat;
+    int channels;
+    float coef[L][K];                      // per phase, reversed to run forward over the input
+    std::vector<std::vector<float>> work;  // per channel: K - 1 history samples, then new input
+    ma_uint64 t = 0;                       // upsampled position of the next output, relative to the first new sample
+
+public:
+    PolyphaseResampler(ma_format inFormat, ma_format outFormat, int channels)
+        : inFormat(inFormat), outFormat(outFormat), channels(channels), work(channels, std::vector<float>(K - 1, 0.0f))
+    {
+        // Low-pass at 90% of the lower Nyquist, Blackman window, evaluated at the upsampled rate
+        const int N = L * K;
+        const double fc = 0.9 * 0.5 / std::max(L, M);
+        for (int n = 0; n < N; n++)
+        {
+            double x = n - (N - 1) / 2.0;
+            double sinc = x == 0 ? 2 * fc : sin(2 * M_PI * fc * x) / (M_PI * x);
+            double window = 0.42 - 0.5 * cos(2 * M_PI * n / (N - 1)) + 0.08 * cos(4 * M_PI * n / (N - 1));
+            coef[n % L][K - 1 - n / L] = (float)(L * sinc * window);
+        }
+    }
+
+    void Process(const void *in, ma_uint64 *inFrames, void *out, ma_uint64 *outFrames) override
+    {
+        const ma_uint64 n = *inFrames;
+        for (int c = 0; c < channels; c++)
+        {
+            work[c].resize(K - 1 + n);
+            float *x = work[c].data() + K - 1;
+            if (inFormat == ma_format_f32)
+            {
+                const float *src = (const float *)in + c;
+                for (ma_uint64 i = 0; i < n; i++)
+                    x[i] = src[i * channels];
+            }
+            else
+            {
+                const int16_t *src = (const int16_t *)in + c;
+                for (ma_uint64 i = 0; i < n; i++)
+                    x[i] = src[i * channels] * (1.0f / 32768.0f);
+            }
+        }
+
+        ma_uint64 produced = 0;
+        float *outF32 = (float *)out;
+        int16_t *outS16 = (int16_t *)out;
+        while (produced < *outFrames && t / L < n)
+        {
+            ma_uint64 base = t / L; // x index base + K - 1 is the newest input sample used
+            const float *h = coef[t % L];
+            for (int c = 0; c < channels; c++)
+            {
+                float y = DotF32(h, work[c].data() + base, K);
+                if (outFormat == ma_format_f32)
+                {
+                    *outF32++ = y;
+                }
+                else
+                {
+                    y = y * 32768.0f;
+                    *outS16++ = (int16_t)(y >= 32767.0f ? 32767 : y <= -32768.0f ? -32768 : lrintf(y));
+                }
+            }
+            produced++;
+            t += M;
+        }
+
+        // Keep the K - 1 samples before the first unconsumed input as history
+        ma_uint64 consumed = std::min<ma_uint64>(t / L, n);
+        for (int c = 0; c < channels; c++)
+        {
+            std::vector<float> &x = work[c];
+            std::copy(x.begin() + consumed, x.begin() + consumed + K - 1, x.begin());
+            x.resize(K - 1);
+        }
+        t -= consumed * L;
+        *inFrames = consumed;
+        *outFrames = produced;
+    }
+};
+
+// Returns a specialized resampler for 3:1, 2:1 and 3:2 (and their inverses) between f32/s16
+// formats with matching channel counts, or nullptr when ma_data_converter should be used.
+inline std::unique_ptr<Resampler> CreateResampler(int inFormat, int inSampleRate, int inChannels,
+                                                  int outFormat, int outSampleRate, int outChannels)
+{
+    auto supported = [](int format) { return format == ma_format_f32 || format == ma_format_s16; };
+    if (inChannels != outChannels || !supported(inFormat) || !supported(outFormat))
+        return nullptr;
+    ma_format in = (ma_format)inFormat, out = (ma_format)outFormat;
+    if (inSampleRate == 3 * outSampleRate)
+        return std::unique_ptr<Resampler>(new PolyphaseResampler<1, 3>(in, out, inChannels));
+    if (inSampleRate == 2 * outSampleRate)
+        return std::unique_ptr<Resampler>(new PolyphaseResampler<1, 2>(in, out, inChannels));
+    if (2 * inSampleRate == 3 * outSampleRate)
+        return std::unique_ptr<Resampler>(new PolyphaseResampler<2, 3>(in, out, inChannels));
+    if (outSampleRate == 3 * inSampleRate)
+        return std::unique_ptr<Resampler>(new PolyphaseResampler<3, 1>(in, out, inChannels));
+    if (outSampleRate == 2 * inSampleRate)
+        return std::unique_ptr<Resampler>(new PolyphaseResampler<2, 1>(in, out, inChannels));
+    if (2 * outSampleRate == 3 * inSampleRate)
+        return std::unique_ptr<Resampler>(new PolyphaseResampler<3, 2>(in, out, inChannels));
+    return nullptr;
+}
@@ -5,20 +5,71 @@
 #include "simpleweb/crypto.hpp"
 #include "simpleweb/mutex.hpp"
 #include "simpleweb/utility.hpp"
+#include <algorithm>
 #include <array>
 #include <atomic>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <limits>
 #include <list>
 #include <random>
+#include <vector>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 
 namespace SimpleWeb {
+  /// XORs length bytes from in with the 4-byte websocket mask into out (in and out may alias).
+  /// Works on 16 (NEON) or 8 bytes at a time; since the key repeats every 4 bytes the phase
+  /// is the same at every word boundary and only the tail needs the per-byte path.
+  inline void apply_mask(unsigned char *out, const unsigned char *in, std::size_t length, const std::array<unsigned char, 4> &mask) noexcept {
+    std::array<unsigned char, 16> mask_bytes;
+    for(std::size_t c = 0; c < mask_bytes.size(); c++)
+      mask_bytes[c] = mask[c % 4];
+
+    std::size_t c = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    uint8x16_t mask16 = vld1q_u8(mask_bytes.data());
+    for(; c + 16 <= length; c += 16)
+      vst1q_u8(out + c, veorq_u8(vld1q_u8(in + c), mask16));
+#endif
+    std::uint64_t mask64;
+    std::memcpy(&mask64, mask_bytes.data(), sizeof(mask64));
+    for(; c + 8 <= length; c += 8) {
+      std::uint64_t word;
+      std::memcpy(&word, in + c, sizeof(word));
+      word ^= mask64;
+      std::memcpy(out + c, &word, sizeof(word));
+    }
+    for(; c < length; c++)
+      out[c] = in[c] ^ mask[c % 4];
+  }
+
   template <class socket_type>
   class SocketClient;
 
   template <class socket_type>
   class SocketClientBase {
   public:
+    class Config;
+
+    /// Read-only stream buffer over bytes owned by someone else, e.g. the connection's receive buffer.
+    class ViewBuf : public std::streambuf {
+    public:
+      void set(const char *data, std::size_t size) noexcept {
+        auto begin = const_cast<char *>(data);
+        setg(begin, begin, begin + size);
+      }
+      const char *unread() const noexcept {
+        return gptr();
+      }
+      std::size_t unread_size() const noexcept {
+        return static_cast<std::size_t>(egptr() - gptr());
+      }
+    };
+
     class InMessage : public std::istream {
       friend class SocketClientBase<socket_type>;
       friend class SocketClient<socket_type>;
@@ -39,7 +90,7 @@ namespace SimpleWeb {
         cached_string = std::unique_ptr<std::string>(new std::string());
 
         try {
-          auto size = streambuf.size();
+          auto size = view ? view_buf.unread_size() : streambuf.size();
           cached_string->resize(size);
           read(&(*cached_string)[0], static_cast<std::streamsize>(size));
           return *cached_string;
@@ -50,12 +101,42 @@ namespace SimpleWeb {
         }
       }
 
+      /// Returns a pointer to the unread message bytes, size() bytes long, without copying or consuming them.
+      /// Only valid until the message is read from or the on_message handler returns.
+      const char *data() noexcept {
+        if(cached_string)
+          return cached_string->data();
+        if(view)
+          return view_buf.unread();
+        return static_cast<const char *>(streambuf.data().data());
+      }
+
     private:
       InMessage() noexcept : std::istream(&streambuf), length(0) {}
+      /// Prepares a pooled message for reuse; the stream buffer keeps its capacity.
+      void reset(unsigned char fin_rsv_opcode, std::size_t length) noexcept {
+        streambuf.consume(streambuf.size());
+        cached_string = nullptr;
+        view = nullptr;
+        rdbuf(&streambuf);
+        clear();
+        this->fin_rsv_opcode = fin_rsv_opcode;
+        this->length = length;
+      }
+      /// Points the message at payload bytes it does not own; nothing is copied.
+      void reset_view(unsigned char fin_rsv_opcode, const char *payload, std::size_t length) noexcept {
+        reset(fin_rsv_opcode, length);
+        view = payload;
+        view_buf.set(payload, length);
+        rdbuf(&view_buf);
+      }
       InMessage(unsigned char fin_rsv_opcode, std::size_t length) noexcept : std::istream(&streambuf), fin_rsv_opcode(fin_rsv_opcode), length(length) {}
       std::size_t length;
       asio::streambuf streambuf;
       std::unique_ptr<std::string> cached_string;
+      /// Set while the message is a view into the receive buffer instead of owning streambuf
+      const char *view = nullptr;
+      ViewBuf view_buf;
     };
 
     /// The buffer is consumed during send operations.
@@ -84,10 +165,38 @@ namespace SimpleWeb {
       std::string http_version, status_code;
       CaseInsensitiveMultimap header;
 
+      /// Number of socket writes, and of frames and bytes they carried. write_frames / write_count is the
+      /// average number of queued frames coalesced into one write.
+      std::atomic<std::size_t> write_count;
+      std::atomic<std::size_t> write_frames;
+      std::atomic<std::size_t> write_bytes;
+      /// Number of socket reads, of frames parsed from them and of InMessage objects allocated (the rest are recycled).
+      std::atomic<std::size_t> read_count;
+      std::atomic<std::size_t> read_frames;
+      std::atomic<std::size_t> in_message_allocs;
+      /// Audio frames currently queued, and audio frames dropped because the queue was too deep or too old.
+      std::atomic<std::size_t> audio_queued;
+      std::atomic<std::size_t> audio_dropped;
+
+      /// When each connection setup step finished, for measuring (re)connect latency.
+      struct Timing {
+        std::chrono::steady_clock::time_point start, resolved, connected, handshaken, upgraded;
+        /// Endpoints were taken from the resolver cache
+        bool resolve_cached = false;
+        /// The TLS handshake resumed a previous session
+        bool session_resumed = false;
+      };
+      Timing timing;
+
     private:
       template <typename... Args>
-      Connection(std::shared_ptr<ScopeRunner> handler_runner_, long timeout_idle, Args &&... args) noexcept
-          : handler_runner(std::move(handler_runner_)), socket(new socket_type(std::forward<Args>(args)...)), timeout_idle(timeout_idle), closed(false) {}
+      Connection(std::shared_ptr<ScopeRunner> handler_runner_, const Config &config, Args &&... args) noexcept
+          : write_count(0), write_frames(0), write_bytes(0), read_count(0), read_frames(0), in_message_allocs(0), audio_queued(0), audio_dropped(0),
+            handler_runner(std::move(handler_runner_)), socket(new socket_type(std::forward<Args>(args)...)), timeout_idle(config.timeout_idle),
+            max_write_bytes(config.max_write_bytes), max_queued_audio(config.max_queued_audio), max_audio_age(config.max_audio_age), closed(false) {
+        std::random_device rd;
+        mask_state = (static_cast<std::uint64_t>(rd()) << 32) | rd();
+      }
 
       std::shared_ptr<ScopeRunner> handler_runner;
 
@@ -96,6 +205,13 @@ namespace SimpleWeb {
       std::shared_ptr<InMessage> in_message;
       std::shared_ptr<InMessage> fragmented_in_message;
 
+      std::vector<char> read_buffer;
+      std::size_t read_begin = 0, read_end = 0;
+      std::size_t read_needed = 0;
+      std::vector<std::shared_ptr<InMessage>> in_message_pool;
+      /// Handed to the handlers for unfragmented frames, viewing the payload in read_buffer
+      std::shared_ptr<InMessage> view_message;
+
       long timeout_idle;
       Mutex timer_mutex;
       std::unique_ptr<asio::steady_timer> timer GUARDED_BY(timer_mutex);
@@ -147,32 +263,64 @@ namespace SimpleWeb {
 
       class OutData {
       public:
-        OutData(std::shared_ptr<OutMessage> out_message_, std::function<void(const error_code)> &&callback_) noexcept
-            : out_message(std::move(out_message_)), callback(std::move(callback_)) {}
+        OutData(std::shared_ptr<OutMessage> out_message_, std::function<void(const error_code)> &&callback_, bool audio_) noexcept
+            : out_message(std::move(out_message_)), callback(std::move(callback_)), audio(audio_), queued(std::chrono::steady_clock::now()) {}
         std::shared_ptr<OutMessage> out_message;
         std::function<void(const error_code)> callback;
+        /// Audio frames may be dropped and are sent after any queued control frame
+        bool audio;
+        std::chrono::steady_clock::time_point queued;
       };
 
       Mutex send_queue_mutex;
       std::list<OutData> send_queue GUARDED_BY(send_queue_mutex);
+      /// Number of frames at the front of send_queue that are being written
+      std::size_t send_in_flight GUARDED_BY(send_queue_mutex) = 0;
+
+      std::size_t max_write_bytes;
+      std::size_t max_queued_audio;
+      std::chrono::milliseconds max_audio_age;
 
+      /// Drains every pending frame, up to max_write_bytes (at least one frame), with a single gathered write.
       void send_from_queue() REQUIRES(send_queue_mutex) {
         auto self = this->shared_from_this();
-        asio::async_write(*self->socket, send_queue.begin()->out_message->streambuf, [self](const error_code &ec, std::size_t /*bytes_transferred*/) {
+        std::vector<asio::const_buffer> buffers;
+        std::size_t bytes = 0;
+        for(auto &out_data : send_queue) {
+          auto size = out_data.out_message->size();
+          if(!buffers.empty() && bytes + size > max_write_bytes)
+            break;
+          buffers.emplace_back(out_data.out_message->streambuf.data());
+          bytes += size;
+        }
+        std::size_t num_frames = buffers.size();
+        send_in_flight = num_frames;
+        asio::async_write(*self->socket, buffers, [self, num_frames](const error_code &ec, std::size_t bytes_transferred) {
           auto lock = self->handler_runner->continue_lock();
           if(!lock)
             return;
           {
             LockGuard lock(self->send_queue_mutex);
             if(!ec) {
-              auto it = self->send_queue.begin();
-              auto callback = std::move(it->callback);
-              self->send_queue.erase(it);
+              self->write_count++;
+              self->write_frames += num_frames;
+              self->write_bytes += bytes_transferred;
+
+              std::vector<std::function<void(const error_code &)>> callbacks;
+              for(std::size_t c = 0; c < num_frames; c++) {
+                auto it = self->send_queue.begin();
+                if(it->callback)
+                  callbacks.emplace_back(std::move(it->callback));
+                if(it->audio)
+                  self->audio_queued--;
+                self->send_queue.erase(it);
+              }
+              self->send_in_flight = 0;
               if(self->send_queue.size() > 0)
                 self->send_from_queue();
 
               lock.unlock();
-              if(callback)
+              for(auto &callback : callbacks)
                 callback(ec);
             }
             else {
@@ -183,6 +331,8 @@ namespace SimpleWeb {
                   callbacks.emplace_back(std::move(out_data.callback));
               }
               self->send_queue.clear();
+              self->send_in_flight = 0;
+              self->audio_queued = 0;
 
               lock.unlock();
               for(auto &callback : callbacks)
@@ -194,63 +344,126 @@ namespace SimpleWeb {
 
       std::atomic<bool> closed;
 
-    public:
-      /// fin_rsv_opcode: 129=one fragment, text, 130=one fragment, binary, 136=close connection.
-      /// See http://tools.ietf.org/html/rfc6455#section-5.2 for more information.
-      void send(const std::shared_ptr<OutMessage> &out_message, const std::function<void(const error_code &)> &callback = nullptr, unsigned char fin_rsv_opcode = 129) {
-        cancel_timeout();
-        set_timeout();
+      std::atomic<std::uint64_t> mask_state;
 
-        // Create mask
+      /// Returns a fresh mask key from the per-connection splitmix64 generator.
+      /// The generator is seeded once from std::random_device when the connection is created.
+      std::array<unsigned char, 4> next_mask() noexcept {
+        std::uint64_t z = mask_state.fetch_add(0x9e3779b97f4a7c15ULL, std::memory_order_relaxed) + 0x9e3779b97f4a7c15ULL;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        z ^= z >> 31;
         std::array<unsigned char, 4> mask;
-        std::uniform_int_distribution<unsigned short> dist(0, 255);
-        std::random_device rd;
         for(std::size_t c = 0; c < 4; c++)
-          mask[c] = static_cast<unsigned char>(dist(rd));
-
-        std::size_t length = out_message->size();
+          mask[c] = static_cast<unsigned char>(z >> (8 * c));
+        return mask;
+      }
 
-        std::size_t max_additional_bytes = 14; // ws protocol adds at most 14 bytes
-        auto out_header_and_message = std::make_shared<OutMessage>(length + max_additional_bytes);
+      /// Writes header, mask and masked payload into one contiguous buffer.
+      std::shared_ptr<OutMessage> frame(const unsigned char *payload, std::size_t length, unsigned char fin_rsv_opcode) {
+        cancel_timeout();
+        set_timeout();
 
-        out_header_and_message->put(static_cast<char>(fin_rsv_opcode));
+        std::array<unsigned char, 14> header; // ws protocol adds at most 14 bytes
+        std::size_t header_size = 0;
+        header[header_size++] = fin_rsv_opcode;
         // Masked (first length byte>=128)
         if(length >= 126) {
           std::size_t num_bytes;
           if(length > 0xffff) {
             num_bytes = 8;
-            out_header_and_message->put(static_cast<char>(127 + 128));
+            header[header_size++] = 127 + 128;
           }
           else {
             num_bytes = 2;
-            out_header_and_message->put(static_cast<char>(126 + 128));
+            header[header_size++] = 126 + 128;
           }
 
           for(std::size_t c = num_bytes - 1; c != static_cast<std::size_t>(-1); c--)
-            out_header_and_message->put((static_cast<unsigned long long>(length) >> (8 * c)) % 256);
+            header[header_size++] = static_cast<unsigned char>((static_cast<unsigned long long>(length) >> (8 * c)) % 256);
         }
         else
-          out_header_and_message->put(static_cast<char>(length + 128));
+          header[header_size++] = static_cast<unsigned char>(length + 128);
 
+        auto mask = next_mask();
         for(std::size_t c = 0; c < 4; c++)
-          out_header_and_message->put(static_cast<char>(mask[c]));
+          header[header_size++] = mask[c];
+
+        auto out_header_and_message = std::make_shared<OutMessage>();
+        auto buffer = out_header_and_message->streambuf.prepare(header_size + length);
+        auto data = static_cast<unsigned char *>(buffer.data());
+        std::memcpy(data, header.data(), header_size);
+        apply_mask(data + header_size, payload, length, mask);
+        out_header_and_message->streambuf.commit(header_size + length);
+        return out_header_and_message;
+      }
 
-        for(std::size_t c = 0; c < length; c++)
-          out_header_and_message->put(out_message->get() ^ mask[c % 4]);
+      /// Queues a frame. Control frames go ahead of every audio frame that is not yet being written.
+      /// Audio frames go last, and the oldest queued audio is dropped once the audio lane is deeper
+      /// than max_queued_audio or older than max_audio_age.
+      void enqueue(const std::shared_ptr<OutMessage> &out_header_and_message, const std::function<void(const error_code &)> &callback, bool audio = false) {
+        std::vector<std::function<void(const error_code &)>> dropped_callbacks;
+        {
+          LockGuard lock(send_queue_mutex);
+          auto pending = send_queue.begin();
+          std::advance(pending, send_in_flight);
+          if(audio) {
+            send_queue.emplace_back(out_header_and_message, std::function<void(const error_code &)>(callback), true);
+            audio_queued++;
+
+            auto now = send_queue.back().queued;
+            for(auto it = pending; it != send_queue.end() && audio_queued > 1;) {
+              if(!it->audio) {
+                ++it;
+                continue;
+              }
+              if(audio_queued <= max_queued_audio && now - it->queued <= max_audio_age)
+                break;
+              if(it->callback)
+                dropped_callbacks.emplace_back(std::move(it->callback));
+              it = send_queue.erase(it);
+              audio_queued--;
+              audio_dropped++;
+            }
+          }
+          else {
+            auto it = std::find_if(pending, send_queue.end(), [](const OutData &out_data) { return out_data.audio; });
+            send_queue.emplace(it, out_header_and_message, std::function<void(const error_code &)>(callback), false);
+          }
+          if(send_in_flight == 0)
+            send_from_queue();
+        }
+        for(auto &dropped_callback : dropped_callbacks)
+          dropped_callback(make_error_code::make_error_code(errc::operation_canceled));
+      }
 
-        LockGuard lock(send_queue_mutex);
-        send_queue.emplace_back(out_header_and_message, callback);
-        if(send_queue.size() == 1)
-          send_from_queue();
+    public:
+      /// fin_rsv_opcode: 129=one fragment, text, 130=one fragment, binary, 136=close connection.
+      /// See http://tools.ietf.org/html/rfc6455#section-5.2 for more information.
+      void send(const std::shared_ptr<OutMessage> &out_message, const std::function<void(const error_code &)> &callback = nullptr, unsigned char fin_rsv_opcode = 129) {
+        std::size_t length = out_message->size();
+        auto out_header_and_message = frame(static_cast<const unsigned char *>(out_message->streambuf.data().data()), length, fin_rsv_opcode);
+        out_message->streambuf.consume(length);
+
+        enqueue(out_header_and_message, callback);
       }
 
-      /// Convenience function for sending a string.
+      /// Convenience function for sending a string. The string is masked straight into the
+      /// outgoing frame, without an intermediate OutMessage.
       /// fin_rsv_opcode: 129=one fragment, text, 130=one fragment, binary, 136=close connection.
       /// See http://tools.ietf.org/html/rfc6455#section-5.2 for more information.
       void send(string_view out_message_str, const std::function<void(const error_code &)> &callback = nullptr, unsigned char fin_rsv_opcode = 129) {
-        auto out_message = std::make_shared<OutMessage>();
-        out_message->write(out_message_str.data(), static_cast<std::streamsize>(out_message_str.size()));
-        send(out_message, callback, fin_rsv_opcode);
+        auto out_header_and_message = frame(reinterpret_cast<const unsigned char *>(out_message_str.data()), out_message_str.size(), fin_rsv_opcode);
+
+        enqueue(out_header_and_message, callback);
+      }
+
+      /// Sends a frame on the audio lane: it is queued behind control frames and may be dropped
+      /// if the connection stalls, see Config::max_queued_audio and Config::max_audio_age.
+      void send_audio(string_view out_message_str, const std::function<void(const error_code &)> &callback = nullptr, unsigned char fin_rsv_opcode = 129) {
+        auto out_header_and_message = frame(reinterpret_cast<const unsigned char *>(out_message_str.data()), out_message_str.size(), fin_rsv_opcode);
+
+        enqueue(out_header_and_message, callback, true);
       }
 
       void send_close(int status, const std::string &reason = "", const std::function<void(const error_code &)> &callback = nullptr) {
@@ -282,6 +495,16 @@ namespace SimpleWeb {
       long timeout_request = 0;
       /// Idle timeout. Defaults to no timeout.
       long timeout_idle = 0;
+      /// Maximum number of bytes gathered into one socket write when several frames are queued.
+      /// A single frame larger than this is still written on its own.
+      std::size_t max_write_bytes = 64 * 1024;
+      /// Maximum number of audio frames (Connection::send_audio) queued or being written; the oldest queued are dropped beyond it.
+      std::size_t max_queued_audio = 25;
+      /// Queued audio older than this is dropped when newer audio arrives.
+      std::chrono::milliseconds max_audio_age = std::chrono::milliseconds(1000);
+      /// Initial size of the receive buffer. Several frames are parsed from one read when they fit.
+      /// The buffer grows if a single frame is larger.
+      std::size_t read_buffer_size = 32 * 1024;
       /// Maximum size of incoming messages. Defaults to architecture maximum.
       /// Exceeding this limit will result in a message_size error code and the connection will be closed.
       std::size_t max_message_size = std::numeric_limits<std::size_t>::max();
@@ -290,18 +513,53 @@ namespace SimpleWeb {
       CaseInsensitiveMultimap header;
       /// Set proxy server (server:port)
       std::string proxy_server;
+      /// WSS client: resolved endpoints are reused for this long before the host is resolved again.
+      std::chrono::seconds resolve_cache_ttl = std::chrono::seconds(300);
+      /// WSS client: seconds to wait for each resolved endpoint before trying the next one. 0 uses timeout_request.
+      long timeout_connect = 3;
+      /// First delay before reconnecting after a failure. The delay doubles for every attempt,
+      /// up to reconnect_delay_max, and a random jitter of up to half the delay is subtracted.
+      /// The first attempt after a clean close is made immediately, once per stable period.
+      std::chrono::milliseconds reconnect_delay_min = std::chrono::milliseconds(500);
+      std::chrono::milliseconds reconnect_delay_max = std::chrono::milliseconds(30000);
+      /// A connection that stays open this long resets the backoff, see also reconnect_succeeded().
+      /// Until then, a server that accepts the upgrade and closes right away is retried with backoff.
+      std::chrono::milliseconds reconnect_stable = std::chrono::milliseconds(10000);
     };
     /// Set before calling start().
     Config config;
 
     std::function<void(std::shared_ptr<Connection>)> on_open;
+    /// The message usually views the connection's receive buffer: read it, or copy it with string(), before returning.
     std::function<void(std::shared_ptr<Connection>, std::shared_ptr<InMessage>)> on_message;
     std::function<void(std::shared_ptr<Connection>, int, const std::string &)> on_close;
     std::function<void(std::shared_ptr<Connection>, const error_code &)> on_error;
     std::function<void(std::shared_ptr<Connection>)> on_ping;
     std::function<void(std::shared_ptr<Connection>)> on_pong;
 
-    bool auto_reconnect;
+    /// Reconnect after the connection is closed or fails, see Config::reconnect_delay_min and Config::reconnect_delay_max.
+    bool auto_reconnect = false;
+
+    /// Reconnect statistics, updated on the io_service thread.
+    struct ReconnectStats {
+      /// Reconnect attempts started by the scheduler
+      std::size_t attempts = 0;
+      /// Connections reopened after a loss
+      std::size_t reconnects = 0;
+      /// Attempts needed by the last reconnect
+      std::size_t last_attempts = 0;
+      /// Time from losing the connection until it was open again
+      std::chrono::milliseconds last_latency = std::chrono::milliseconds(0);
+      std::chrono::milliseconds max_latency = std::chrono::milliseconds(0);
+    };
+    ReconnectStats reconnect_stats;
+
+    /// Call on the io_service thread once the application considers the connection recovered
+    /// (e.g. its session started): the backoff and the immediate retry start over.
+    void reconnect_succeeded() {
+      reconnect_backoff = 0;
+      reconnect_immediate = true;
+    }
 
     void start() {
       {
@@ -344,6 +602,13 @@ namespace SimpleWeb {
         io_service->poll();
     }
 
+    /// Blocks running the io_service until stop() is called or it runs out of work.
+    void run()
+    {
+      if(internal_io_service)
+        io_service->run();
+    }
+
     void stop() noexcept {
       std::lock_guard<std::mutex> lock(start_stop_mutex);
 
@@ -353,14 +618,39 @@ namespace SimpleWeb {
           connection->close();
       }
 
+      if(reconnect_timer) {
+        error_code ec;
+        reconnect_timer->cancel(ec);
+      }
+
       if(internal_io_service)
         io_service->stop();
     }
 
+    /// Sends on the current connection; dropped while there is none
     void send(string_view out_message_str)
     {
+      std::shared_ptr<Connection> connection;
+      {
+        LockGuard lock(connection_mutex);
+        connection = this->connection;
+      }
+      if(!connection)
+        return;
       connection->send(out_message_str);
-    }    
+    }
+
+    void send_audio(string_view out_message_str)
+    {
+      std::shared_ptr<Connection> connection;
+      {
+        LockGuard lock(connection_mutex);
+        connection = this->connection;
+      }
+      if(!connection)
+        return;
+      connection->send_audio(out_message_str);
+    }
 
     std::shared_ptr<Connection> get_connection() {
       LockGuard lock(connection_mutex);
@@ -380,6 +670,9 @@ namespace SimpleWeb {
   protected:
     std::mutex start_stop_mutex;
 
+    /// Number of InMessage objects each connection keeps for reuse
+    static constexpr std::size_t in_message_pool_size = 4;
+
     bool internal_io_service = false;
 
     std::string host;
@@ -392,6 +685,18 @@ namespace SimpleWeb {
 
     std::shared_ptr<ScopeRunner> handler_runner;
 
+    std::unique_ptr<asio::steady_timer> reconnect_timer;
+    bool reconnect_pending = false;
+    /// Attempts since the connection was last open, 0 while connected
+    std::size_t reconnect_attempt = 0;
+    /// Doublings of the reconnect delay, reset only once a connection proved stable
+    std::size_t reconnect_backoff = 0;
+    /// The zero-delay retry after a clean close is still available
+    bool reconnect_immediate = true;
+    std::chrono::steady_clock::time_point reconnect_opened;
+    std::chrono::steady_clock::time_point reconnect_lost;
+    std::minstd_rand reconnect_rand{std::random_device{}()};
+
     SocketClientBase(const std::string &host_port_path, unsigned short default_port) noexcept : default_port(default_port), handler_runner(new ScopeRunner()) {
       auto host_port_end = host_port_path.find('/');
       auto host_port = parse_host_port(host_port_path.substr(0, host_port_end), default_port);
@@ -460,7 +765,7 @@ namespace SimpleWeb {
           return;
         if(!ec) {
           connection->set_timeout(this->config.timeout_request);
-          asio::async_read_until(*connection->socket, connection->in_message->streambuf, "\r\n\r\n", [this, connection, nonce_base64](const error_code &ec, std::size_t bytes_transferred) {
+          asio::async_read_until(*connection->socket, connection->in_message->streambuf, "\r\n\r\n", [this, connection, nonce_base64](const error_code &ec, std::size_t /*bytes_transferred*/) {
             connection->cancel_timeout();
             auto lock = connection->handler_runner->continue_lock();
             if(!lock)
@@ -469,8 +774,7 @@ namespace SimpleWeb {
               // connection->in_message->streambuf.size() is not necessarily the same as bytes_transferred, from Boost-docs:
               // "After a successful async_read_until operation, the streambuf may contain additional data beyond the delimiter"
               // The chosen solution is to extract lines from the stream directly when parsing the header. What is left of the
-              // streambuf (maybe some bytes of a message) is appended to in the next async_read-function
-              std::size_t num_additional_bytes = connection->in_message->streambuf.size() - bytes_transferred;
+              // streambuf (maybe some bytes of a message) is moved to the receive buffer by start_read
 
               if(!ResponseMessage::parse(*connection->in_message, connection->http_version, connection->status_code, connection->header)) {
                 this->connection_error(connection, make_error_code::make_error_code(errc::protocol_error));
@@ -484,8 +788,9 @@ namespace SimpleWeb {
               static auto ws_magic_string = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
               if(header_it != connection->header.end() &&
                  Crypto::Base64::decode(header_it->second) == Crypto::sha1(*nonce_base64 + ws_magic_string)) {
+                connection->timing.upgraded = std::chrono::steady_clock::now();
                 this->connection_open(connection);
-                read_message(connection, num_additional_bytes);
+                this->start_read(connection);
               }
               else
                 this->connection_error(connection, make_error_code::make_error_code(errc::protocol_error));
@@ -499,210 +804,270 @@ namespace SimpleWeb {
       });
     }
 
-    void read_message(const std::shared_ptr<Connection> &connection, std::size_t num_additional_bytes) {
-      asio::async_read(*connection->socket, connection->in_message->streambuf, asio::transfer_exactly(num_additional_bytes > 2 ? 0 : 2 - num_additional_bytes), [this, connection](const error_code &ec, std::size_t bytes_transferred) {
-        auto lock = connection->handler_runner->continue_lock();
-        if(!lock)
-          return;
-        if(!ec) {
-          if(bytes_transferred == 0 && connection->in_message->streambuf.size() == 0) { // TODO: This might happen on server at least, might also happen here
-            this->read_message(connection, 0);
-            return;
-          }
-          std::size_t num_additional_bytes = connection->in_message->streambuf.size() - bytes_transferred;
+    /// Returns an InMessage holding a copy of the given payload, reusing a pooled message that is no longer referenced elsewhere.
+    std::shared_ptr<InMessage> get_in_message(const std::shared_ptr<Connection> &connection, unsigned char fin_rsv_opcode, const char *payload, std::size_t length) {
+      std::shared_ptr<InMessage> in_message;
+      for(auto &pooled : connection->in_message_pool) {
+        if(pooled.use_count() == 1) {
+          in_message = pooled;
+          in_message->reset(fin_rsv_opcode, length);
+          break;
+        }
+      }
+      if(!in_message) {
+        in_message = std::shared_ptr<InMessage>(new InMessage(fin_rsv_opcode, length));
+        connection->in_message_allocs++;
+        if(connection->in_message_pool.size() < in_message_pool_size)
+          connection->in_message_pool.emplace_back(in_message);
+      }
+      auto buffer = in_message->streambuf.prepare(length);
+      std::memcpy(buffer.data(), payload, length);
+      in_message->streambuf.commit(length);
+      return in_message;
+    }
 
-          std::array<unsigned char, 2> first_bytes;
-          connection->in_message->read(reinterpret_cast<char *>(&first_bytes[0]), 2);
+    /// Returns a message viewing the payload in the receive buffer, valid until dispatch_frames() moves on.
+    /// The view message is reused unless a handler kept a reference to the previous one.
+    std::shared_ptr<InMessage> get_view_message(const std::shared_ptr<Connection> &connection, unsigned char fin_rsv_opcode, const char *payload, std::size_t length) {
+      if(!connection->view_message || connection->view_message.use_count() > 1) {
+        connection->view_message = std::shared_ptr<InMessage>(new InMessage());
+        connection->in_message_allocs++;
+      }
+      connection->view_message->reset_view(fin_rsv_opcode, payload, length);
+      return connection->view_message;
+    }
 
-          connection->in_message->fin_rsv_opcode = first_bytes[0];
+    /// Moves bytes that arrived together with the upgrade response into the receive buffer and starts reading frames.
+    void start_read(const std::shared_ptr<Connection> &connection) {
+      auto &streambuf = connection->in_message->streambuf;
+      connection->read_buffer.resize(std::max(config.read_buffer_size, streambuf.size()));
+      connection->read_end = asio::buffer_copy(asio::buffer(connection->read_buffer), streambuf.data());
+      streambuf.consume(connection->read_end);
+      if(dispatch_frames(connection))
+        read_message(connection);
+    }
 
-          // Close connection if masked message from server (protocol error)
-          if(first_bytes[1] >= 128) {
-            const std::string reason("message from server masked");
-            connection->send_close(1002, reason);
-            this->connection_close(connection, 1002, reason);
-            return;
-          }
+    /// Reads whatever is available into the receive buffer, then dispatches every complete frame in it.
+    void read_message(const std::shared_ptr<Connection> &connection) {
+      auto &buffer = connection->read_buffer;
+      if(connection->read_begin > 0) {
+        std::memmove(&buffer[0], &buffer[connection->read_begin], connection->read_end - connection->read_begin);
+        connection->read_end -= connection->read_begin;
+        connection->read_begin = 0;
+      }
+      if(buffer.size() < connection->read_needed)
+        buffer.resize(connection->read_needed);
 
-          std::size_t length = (first_bytes[1] & 127);
+      connection->socket->async_read_some(asio::buffer(&buffer[connection->read_end], buffer.size() - connection->read_end), [this, connection](const error_code &ec, std::size_t bytes_transferred) {
+        auto lock = connection->handler_runner->continue_lock();
+        if(!lock)
+          return;
+        if(!ec) {
+          connection->read_count++;
+          connection->read_end += bytes_transferred;
+          if(this->dispatch_frames(connection))
+            this->read_message(connection);
+        }
+        else
+          this->connection_error(connection, ec);
+      });
+    }
 
-          if(length == 126) {
-            // 2 next bytes is the size of content
-            asio::async_read(*connection->socket, connection->in_message->streambuf, asio::transfer_exactly(num_additional_bytes > 2 ? 0 : 2 - num_additional_bytes), [this, connection](const error_code &ec, std::size_t bytes_transferred) {
-              auto lock = connection->handler_runner->continue_lock();
-              if(!lock)
-                return;
-              if(!ec) {
-                std::size_t num_additional_bytes = connection->in_message->streambuf.size() - bytes_transferred;
+    /// Parses and handles every complete frame in the receive buffer.
+    /// Returns false if reading should stop, for instance after a close frame.
+    bool dispatch_frames(const std::shared_ptr<Connection> &connection) {
+      for(;;) {
+        std::size_t available = connection->read_end - connection->read_begin;
+        auto bytes = reinterpret_cast<const unsigned char *>(&connection->read_buffer[connection->read_begin]);
+        if(available < 2) {
+          connection->read_needed = 2;
+          return true;
+        }
 
-                std::array<unsigned char, 2> length_bytes;
-                connection->in_message->read(reinterpret_cast<char *>(&length_bytes[0]), 2);
+        // Close connection if masked message from server (protocol error)
+        if(bytes[1] >= 128) {
+          const std::string reason("message from server masked");
+          connection->send_close(1002, reason);
+          this->connection_close(connection, 1002, reason);
+          return false;
+        }
 
-                std::size_t length = 0;
-                std::size_t num_bytes = 2;
-                for(std::size_t c = 0; c < num_bytes; c++)
-                  length += static_cast<std::size_t>(length_bytes[c]) << (8 * (num_bytes - 1 - c));
+        std::size_t length = (bytes[1] & 127);
+        std::size_t header_size = 2;
+        if(length == 126) // 2 next bytes is the size of content
+          header_size = 4;
+        else if(length == 127) // 8 next bytes is the size of content
+          header_size = 10;
+        if(available < header_size) {
+          connection->read_needed = header_size;
+          return true;
+        }
+        if(header_size > 2) {
+          length = 0;
+          for(std::size_t c = 2; c < header_size; c++)
+            length = (length << 8) + static_cast<std::size_t>(bytes[c]);
+        }
 
-                connection->in_message->length = length;
-                this->read_message_content(connection, num_additional_bytes);
-              }
-              else
-                this->connection_error(connection, ec);
-            });
-          }
-          else if(length == 127) {
-            // 8 next bytes is the size of content
-            asio::async_read(*connection->socket, connection->in_message->streambuf, asio::transfer_exactly(num_additional_bytes > 8 ? 0 : 8 - num_additional_bytes), [this, connection](const error_code &ec, std::size_t bytes_transferred) {
-              auto lock = connection->handler_runner->continue_lock();
-              if(!lock)
-                return;
-              if(!ec) {
-                std::size_t num_additional_bytes = connection->in_message->streambuf.size() - bytes_transferred;
+        std::size_t fragmented_length = connection->fragmented_in_message ? connection->fragmented_in_message->length : 0;
+        if(length > config.max_message_size - std::min(fragmented_length, config.max_message_size) ||
+           length > connection->read_buffer.max_size() - header_size) {
+          connection_error(connection, make_error_code::make_error_code(errc::message_size));
+          const int status = 1009;
+          const std::string reason = "message too big";
+          connection->send_close(status, reason);
+          connection_close(connection, status, reason);
+          return false;
+        }
+        if(available - header_size < length) {
+          connection->read_needed = header_size + length;
+          return true;
+        }
 
-                std::array<unsigned char, 8> length_bytes;
-                connection->in_message->read(reinterpret_cast<char *>(&length_bytes[0]), 8);
+        auto payload = reinterpret_cast<const char *>(bytes + header_size);
+        // Only the first fragment of a fragmented message outlives this call and needs its own copy
+        bool first_fragment = (bytes[0] & 0x80) == 0 && (bytes[0] & 0x0f) < 8 && !connection->fragmented_in_message;
+        auto in_message = first_fragment ? get_in_message(connection, bytes[0], payload, length) : get_view_message(connection, bytes[0], payload, length);
+        connection->read_begin += header_size + length;
+        connection->read_frames++;
+        if(!handle_frame(connection, in_message))
+          return false;
+      }
+    }
 
-                std::size_t length = 0;
-                std::size_t num_bytes = 8;
-                for(std::size_t c = 0; c < num_bytes; c++)
-                  length += static_cast<std::size_t>(length_bytes[c]) << (8 * (num_bytes - 1 - c));
+    /// Handles one received frame. Returns false if the connection is closing.
+    bool handle_frame(const std::shared_ptr<Connection> &connection, const std::shared_ptr<InMessage> &in_message) {
+      // If connection close
+      if((in_message->fin_rsv_opcode & 0x0f) == 8) {
+        connection->cancel_timeout();
+        connection->set_timeout();
 
-                connection->in_message->length = length;
-                this->read_message_content(connection, num_additional_bytes);
-              }
-              else
-                this->connection_error(connection, ec);
-            });
-          }
-          else {
-            connection->in_message->length = length;
-            this->read_message_content(connection, num_additional_bytes);
-          }
+        int status = 0;
+        if(in_message->length >= 2) {
+          unsigned char byte1 = in_message->get();
+          unsigned char byte2 = in_message->get();
+          status = (static_cast<int>(byte1) << 8) + byte2;
         }
-        else
-          this->connection_error(connection, ec);
-      });
-    }
 
-    void read_message_content(const std::shared_ptr<Connection> &connection, std::size_t num_additional_bytes) {
-      if(connection->in_message->length + (connection->fragmented_in_message ? connection->fragmented_in_message->length : 0) > config.max_message_size) {
-        connection_error(connection, make_error_code::make_error_code(errc::message_size));
-        const int status = 1009;
-        const std::string reason = "message too big";
+        auto reason = in_message->string();
         connection->send_close(status, reason);
-        connection_close(connection, status, reason);
-        return;
+        this->connection_close(connection, status, reason);
+        return false;
       }
-      asio::async_read(*connection->socket, connection->in_message->streambuf, asio::transfer_exactly(num_additional_bytes > connection->in_message->length ? 0 : connection->in_message->length - num_additional_bytes), [this, connection](const error_code &ec, std::size_t bytes_transferred) {
-        auto lock = connection->handler_runner->continue_lock();
-        if(!lock)
-          return;
-        if(!ec) {
-          std::size_t num_additional_bytes = connection->in_message->streambuf.size() - bytes_transferred;
-          std::shared_ptr<InMessage> next_in_message;
-          if(num_additional_bytes > 0) { // Extract bytes that are not extra bytes in buffer (only happen when several messages are sent in upgrade response)
-            next_in_message = connection->in_message;
-            connection->in_message = std::shared_ptr<InMessage>(new InMessage(next_in_message->fin_rsv_opcode, next_in_message->length));
-            std::ostream ostream(&connection->in_message->streambuf);
-            for(std::size_t c = 0; c < next_in_message->length; ++c)
-              ostream.put(next_in_message->get());
-          }
-          else
-            next_in_message = std::shared_ptr<InMessage>(new InMessage());
-
-          // If connection close
-          if((connection->in_message->fin_rsv_opcode & 0x0f) == 8) {
-            connection->cancel_timeout();
-            connection->set_timeout();
-
-            int status = 0;
-            if(connection->in_message->length >= 2) {
-              unsigned char byte1 = connection->in_message->get();
-              unsigned char byte2 = connection->in_message->get();
-              status = (static_cast<int>(byte1) << 8) + byte2;
-            }
-
-            auto reason = connection->in_message->string();
-            connection->send_close(status, reason);
-            this->connection_close(connection, status, reason);
-          }
-          // If ping
-          else if((connection->in_message->fin_rsv_opcode & 0x0f) == 9) {
-            connection->cancel_timeout();
-            connection->set_timeout();
+      // If ping
+      else if((in_message->fin_rsv_opcode & 0x0f) == 9) {
+        connection->cancel_timeout();
+        connection->set_timeout();
 
-            // Send pong
-            auto out_message = std::make_shared<OutMessage>();
-            *out_message << connection->in_message->string();
-            connection->send(out_message, nullptr, connection->in_message->fin_rsv_opcode + 1);
+        // Send pong
+        auto out_message = std::make_shared<OutMessage>();
+        *out_message << in_message->string();
+        connection->send(out_message, nullptr, in_message->fin_rsv_opcode + 1);
 
-            if(this->on_ping)
-              this->on_ping(connection);
+        if(this->on_ping)
+          this->on_ping(connection);
+      }
+      // If pong
+      else if((in_message->fin_rsv_opcode & 0x0f) == 10) {
+        connection->cancel_timeout();
+        connection->set_timeout();
 
-            // Next message
-            connection->in_message = next_in_message;
-            this->read_message(connection, num_additional_bytes);
-          }
-          // If pong
-          else if((connection->in_message->fin_rsv_opcode & 0x0f) == 10) {
-            connection->cancel_timeout();
-            connection->set_timeout();
+        if(this->on_pong)
+          this->on_pong(connection);
+      }
+      // If fragmented message and not final fragment
+      else if((in_message->fin_rsv_opcode & 0x80) == 0) {
+        if(!connection->fragmented_in_message) {
+          connection->fragmented_in_message = in_message;
+          connection->fragmented_in_message->fin_rsv_opcode |= 0x80;
+        }
+        else {
+          connection->fragmented_in_message->length += in_message->length;
+          std::ostream ostream(&connection->fragmented_in_message->streambuf);
+          ostream << in_message->rdbuf();
+        }
+      }
+      else {
+        connection->cancel_timeout();
+        connection->set_timeout();
 
-            if(this->on_pong)
-              this->on_pong(connection);
+        if(this->on_message) {
+          if(connection->fragmented_in_message) {
+            connection->fragmented_in_message->length += in_message->length;
+            std::ostream ostream(&connection->fragmented_in_message->streambuf);
+            ostream << in_message->rdbuf();
 
-            // Next message
-            connection->in_message = next_in_message;
-            this->read_message(connection, num_additional_bytes);
+            this->on_message(connection, connection->fragmented_in_message);
           }
-          // If fragmented message and not final fragment
-          else if((connection->in_message->fin_rsv_opcode & 0x80) == 0) {
-            if(!connection->fragmented_in_message) {
-              connection->fragmented_in_message = connection->in_message;
-              connection->fragmented_in_message->fin_rsv_opcode |= 0x80;
-            }
-            else {
-              connection->fragmented_in_message->length += connection->in_message->length;
-              std::ostream ostream(&connection->fragmented_in_message->streambuf);
-              ostream << connection->in_message->rdbuf();
-            }
+          else
+            this->on_message(connection, in_message);
+        }
 
-            // Next message
-            connection->in_message = next_in_message;
-            this->read_message(connection, num_additional_bytes);
-          }
-          else {
-            connection->cancel_timeout();
-            connection->set_timeout();
+        // Only reset fragmented_message for non-control frames (control frames can be in between a fragmented message)
+        connection->fragmented_in_message = nullptr;
+      }
+      return true;
+    }
 
-            if(this->on_message) {
-              if(connection->fragmented_in_message) {
-                connection->fragmented_in_message->length += connection->in_message->length;
-                std::ostream ostream(&connection->fragmented_in_message->streambuf);
-                ostream << connection->in_message->rdbuf();
+    /// Schedules a single connect() for a lost connection. An error followed by a close of the same
+    /// connection, or the loss of a connection that was already replaced, does not add another attempt.
+    void schedule_reconnect(const std::shared_ptr<Connection> &connection, bool clean) {
+      {
+        LockGuard lock(connection_mutex);
+        if(connection != this->connection)
+          return;
+      }
+      if(reconnect_pending)
+        return;
+      reconnect_pending = true;
 
-                this->on_message(connection, connection->fragmented_in_message);
-              }
-              else
-                this->on_message(connection, connection->in_message);
-            }
+      auto now = std::chrono::steady_clock::now();
+      if(reconnect_attempt == 0) {
+        reconnect_lost = now;
+        if(now - reconnect_opened >= config.reconnect_stable)
+          reconnect_succeeded();
+      }
 
-            // Next message
-            connection->in_message = next_in_message;
-            // Only reset fragmented_message for non-control frames (control frames can be in between a fragmented message)
-            connection->fragmented_in_message = nullptr;
-            this->read_message(connection, num_additional_bytes);
-          }
-        }
-        else
-          this->connection_error(connection, ec);
+      std::chrono::milliseconds delay(0);
+      if(clean && reconnect_immediate)
+        reconnect_immediate = false;
+      else {
+        delay = config.reconnect_delay_max;
+        auto shift = std::min<std::size_t>(reconnect_backoff, 16);
+        if(config.reconnect_delay_min.count() <= (config.reconnect_delay_max.count() >> shift))
+          delay = config.reconnect_delay_min * (1 << shift);
+        std::uniform_int_distribution<long long> jitter(0, delay.count() / 2);
+        delay -= std::chrono::milliseconds(jitter(reconnect_rand));
+        reconnect_backoff++;
+      }
+      reconnect_attempt++;
+      reconnect_stats.attempts++;
+
+      if(!reconnect_timer)
+        reconnect_timer = std::unique_ptr<asio::steady_timer>(new asio::steady_timer(*io_service));
+      reconnect_timer->expires_after(delay);
+      reconnect_timer->async_wait([this](const error_code &ec) {
+        auto lock = handler_runner->continue_lock();
+        if(!lock)
+          return;
+        reconnect_pending = false;
+        if(!ec)
+          this->connect();
       });
     }
 
-    void connection_open(const std::shared_ptr<Connection> &connection) const {
+    void connection_open(const std::shared_ptr<Connection> &connection) {
       connection->cancel_timeout();
       connection->set_timeout();
 
+      reconnect_opened = std::chrono::steady_clock::now();
+      if(reconnect_attempt > 0) {
+        reconnect_stats.reconnects++;
+        reconnect_stats.last_attempts = reconnect_attempt;
+        reconnect_stats.last_latency = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - reconnect_lost);
+        reconnect_stats.max_latency = std::max(reconnect_stats.max_latency, reconnect_stats.last_latency);
+        reconnect_attempt = 0;
+      }
+
       if(on_open)
         on_open(connection);
     }
@@ -713,11 +1078,9 @@ namespace SimpleWeb {
 
       if(on_close)
         on_close(connection, status, reason);
-      
+
       if(auto_reconnect)
-      {
-        this->connect();
-      }
+        schedule_reconnect(connection, true);
     }
 
     void connection_error(const std::shared_ptr<Connection> &connection, const error_code &ec) {
@@ -726,11 +1089,9 @@ namespace SimpleWeb {
 
       if(on_error)
         on_error(connection, ec);
-      
+
       if(auto_reconnect)
-      {
-        this->connect();
-      }
+        schedule_reconnect(connection, false);
     }
   };
 
@@ -748,7 +1109,7 @@ namespace SimpleWeb {
   protected:
     void connect() override {
       LockGuard lock(connection_mutex);
-      auto connection = this->connection = std::shared_ptr<Connection>(new Connection(handler_runner, config.timeout_idle, *io_service));
+      auto connection = this->connection = std::shared_ptr<Connection>(new Connection(handler_runner, config, *io_service));
       lock.unlock();
 
       std::pair<std::string, std::string> host_port;
@@ -760,6 +1121,7 @@ namespace SimpleWeb {
       }
 
       auto resolver = std::make_shared<asio::ip::tcp::resolver>(*io_service);
+      connection->timing.start = std::chrono::steady_clock::now();
       connection->set_timeout(config.timeout_request);
       async_resolve(*resolver, host_port, [this, connection, resolver](const error_code &ec, resolver_results results) {
         connection->cancel_timeout();
@@ -767,6 +1129,7 @@ namespace SimpleWeb {
         if(!lock)
           return;
         if(!ec) {
+          connection->timing.resolved = std::chrono::steady_clock::now();
           connection->set_timeout(this->config.timeout_request);
           asio::async_connect(*connection->socket, results, [this, connection, resolver](const error_code &ec, async_connect_endpoint /*endpoint*/) {
             connection->cancel_timeout();
@@ -774,6 +1137,7 @@ namespace SimpleWeb {
             if(!lock)
               return;
             if(!ec) {
+              connection->timing.connected = connection->timing.handshaken = std::chrono::steady_clock::now();
               asio::ip::tcp::no_delay option(true);
               connection->socket->set_option(option);
 
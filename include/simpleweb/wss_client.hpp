@@ -28,7 +28,15 @@ namespace SimpleWeb {
     SocketClient(const std::string &server_port_path, bool verify_certificate = true,
                  const std::string &certification_file = std::string(), const std::string &private_key_file = std::string(),
                  const std::string &verify_file = std::string())
-        : SocketClientBase<WSS>::SocketClientBase(server_port_path, 443), context(asio::ssl::context::tlsv12) {
+        : SocketClientBase<WSS>::SocketClientBase(server_port_path, 443), context(asio::ssl::context::tls_client) {
+      // TLS 1.2 or 1.3, whichever the server supports
+      context.set_options(asio::ssl::context::default_workarounds | asio::ssl::context::no_sslv2 | asio::ssl::context::no_sslv3 |
+                          asio::ssl::context::no_tlsv1 | asio::ssl::context::no_tlsv1_1);
+      // Keep the last session (TLS 1.3 tickets arrive after the handshake) to resume it on reconnect
+      SSL_CTX_set_session_cache_mode(context.native_handle(), SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+      SSL_CTX_set_ex_data(context.native_handle(), client_ex_index(), this);
+      SSL_CTX_sess_set_new_cb(context.native_handle(), &SocketClient::new_session);
+
       if(certification_file.size() > 0 && private_key_file.size() > 0) {
         context.use_certificate_chain_file(certification_file);
         context.use_private_key_file(private_key_file, asio::ssl::context::pem);
@@ -51,9 +59,34 @@ namespace SimpleWeb {
   protected:
     asio::ssl::context context;
 
+    std::pair<std::string, std::string> resolved_host_port;
+    std::vector<asio::ip::tcp::endpoint> resolved_endpoints;
+    std::chrono::steady_clock::time_point resolved_time;
+    std::shared_ptr<SSL_SESSION> tls_session;
+
+    /// SSL_CTX ex_data slot holding the client (asio uses the app_data slot for its verify callback)
+    static int client_ex_index() {
+      static int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+      return index;
+    }
+
+    static int new_session(SSL *ssl, SSL_SESSION *session) {
+      auto client = static_cast<SocketClient *>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), client_ex_index()));
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+      // Keep a copy: OpenSSL marks the connection's own session non-resumable when the
+      // connection is dropped without a TLS shutdown, which is how most reconnects start.
+      if(auto copy = SSL_SESSION_dup(session))
+        client->tls_session = std::shared_ptr<SSL_SESSION>(copy, SSL_SESSION_free);
+      return 0;
+#else
+      client->tls_session = std::shared_ptr<SSL_SESSION>(session, SSL_SESSION_free);
+      return 1; // We keep the reference
+#endif
+    }
+
     void connect() override {
       LockGuard connection_lock(connection_mutex);
-      auto connection = this->connection = std::shared_ptr<Connection>(new Connection(handler_runner, config.timeout_idle, *io_service, context));
+      auto connection = this->connection = std::shared_ptr<Connection>(new Connection(handler_runner, config, *io_service, context));
       connection_lock.unlock();
 
       std::pair<std::string, std::string> host_port;
@@ -64,76 +97,112 @@ namespace SimpleWeb {
         host_port = {proxy_host_port.first, std::to_string(proxy_host_port.second)};
       }
 
+      connection->timing.start = std::chrono::steady_clock::now();
+      if(!resolved_endpoints.empty() && resolved_host_port == host_port && connection->timing.start - resolved_time < config.resolve_cache_ttl) {
+        connection->timing.resolved = connection->timing.start;
+        connection->timing.resolve_cached = true;
+        connect_endpoint(connection, 0);
+        return;
+      }
+
       auto resolver = std::make_shared<asio::ip::tcp::resolver>(*io_service);
       connection->set_timeout(config.timeout_request);
-      async_resolve(*resolver, host_port, [this, connection, resolver](const error_code &ec, resolver_results results) {
+      async_resolve(*resolver, host_port, [this, connection, resolver, host_port](const error_code &ec, resolver_results results) {
+        connection->cancel_timeout();
+        auto lock = connection->handler_runner->continue_lock();
+        if(!lock)
+          return;
+        if(!ec) {
+          connection->timing.resolved = std::chrono::steady_clock::now();
+          this->resolved_host_port = host_port;
+          this->resolved_endpoints.assign(results.begin(), results.end());
+          this->resolved_time = connection->timing.resolved;
+          this->connect_endpoint(connection, 0);
+        }
+        else
+          this->connection_error(connection, ec);
+      });
+    }
+
+    /// Connects to resolved_endpoints[index], moving on to the next endpoint after Config::timeout_connect seconds or an error.
+    void connect_endpoint(const std::shared_ptr<Connection> &connection, std::size_t index) {
+      if(index >= resolved_endpoints.size()) {
+        resolved_endpoints.clear(); // Resolve again on the next attempt
+        connection_error(connection, make_error_code::make_error_code(errc::host_unreachable));
+        return;
+      }
+      error_code ec;
+      connection->socket->lowest_layer().close(ec);
+      connection->set_timeout(config.timeout_connect > 0 ? config.timeout_connect : config.timeout_request);
+      connection->socket->lowest_layer().async_connect(resolved_endpoints[index], [this, connection, index](const error_code &ec) {
         connection->cancel_timeout();
         auto lock = connection->handler_runner->continue_lock();
         if(!lock)
           return;
         if(!ec) {
-          connection->set_timeout(this->config.timeout_request);
-          asio::async_connect(connection->socket->lowest_layer(), results, [this, connection, resolver](const error_code &ec, async_connect_endpoint /*endpoint*/) {
-            connection->cancel_timeout();
-            auto lock = connection->handler_runner->continue_lock();
-            if(!lock)
-              return;
-            if(!ec) {
-              asio::ip::tcp::no_delay option(true);
-              error_code ec;
-              connection->socket->lowest_layer().set_option(option, ec);
-
-              if(!this->config.proxy_server.empty()) {
-                auto streambuf = std::make_shared<asio::streambuf>();
-                std::ostream ostream(streambuf.get());
-                auto host_port = this->host + ':' + std::to_string(this->port);
-                ostream << "CONNECT " + host_port + " HTTP/1.1\r\n"
-                        << "Host: " << host_port << "\r\n\r\n";
+          connection->timing.connected = std::chrono::steady_clock::now();
+          asio::ip::tcp::no_delay option(true);
+          error_code ec;
+          connection->socket->lowest_layer().set_option(option, ec);
+
+          if(!this->config.proxy_server.empty()) {
+            auto streambuf = std::make_shared<asio::streambuf>();
+            std::ostream ostream(streambuf.get());
+            auto host_port = this->host + ':' + std::to_string(this->port);
+            ostream << "CONNECT " + host_port + " HTTP/1.1\r\n"
+                    << "Host: " << host_port << "\r\n\r\n";
+            connection->set_timeout(this->config.timeout_request);
+            asio::async_write(connection->socket->next_layer(), *streambuf, [this, connection, streambuf](const error_code &ec, std::size_t /*bytes_transferred*/) {
+              connection->cancel_timeout();
+              auto lock = connection->handler_runner->continue_lock();
+              if(!lock)
+                return;
+              if(!ec) {
                 connection->set_timeout(this->config.timeout_request);
-                asio::async_write(connection->socket->next_layer(), *streambuf, [this, connection, streambuf](const error_code &ec, std::size_t /*bytes_transferred*/) {
+                asio::async_read_until(connection->socket->next_layer(), connection->in_message->streambuf, "\r\n\r\n", [this, connection](const error_code &ec, std::size_t /*bytes_transferred*/) {
                   connection->cancel_timeout();
                   auto lock = connection->handler_runner->continue_lock();
                   if(!lock)
                     return;
                   if(!ec) {
-                    connection->set_timeout(this->config.timeout_request);
-                    asio::async_read_until(connection->socket->next_layer(), connection->in_message->streambuf, "\r\n\r\n", [this, connection](const error_code &ec, std::size_t /*bytes_transferred*/) {
-                      connection->cancel_timeout();
-                      auto lock = connection->handler_runner->continue_lock();
-                      if(!lock)
-                        return;
-                      if(!ec) {
-                        if(!ResponseMessage::parse(*connection->in_message, connection->http_version, connection->status_code, connection->header))
-                          this->connection_error(connection, make_error_code::make_error_code(errc::protocol_error));
-                        else {
-                          if(connection->status_code.compare(0, 3, "200") != 0)
-                            this->connection_error(connection, make_error_code::make_error_code(errc::permission_denied));
-                          else
-                            this->handshake(connection);
-                        }
-                      }
+                    if(!ResponseMessage::parse(*connection->in_message, connection->http_version, connection->status_code, connection->header))
+                      this->connection_error(connection, make_error_code::make_error_code(errc::protocol_error));
+                    else {
+                      if(connection->status_code.compare(0, 3, "200") != 0)
+                        this->connection_error(connection, make_error_code::make_error_code(errc::permission_denied));
                       else
-                        this->connection_error(connection, ec);
-                    });
+                        this->handshake(connection);
+                    }
                   }
                   else
                     this->connection_error(connection, ec);
                 });
               }
               else
-                this->handshake(connection);
-            }
-            else
-              this->connection_error(connection, ec);
-          });
+                this->connection_error(connection, ec);
+            });
+          }
+          else
+            this->handshake(connection);
         }
         else
-          this->connection_error(connection, ec);
+          this->connect_endpoint(connection, index + 1);
       });
     }
 
     void handshake(const std::shared_ptr<Connection> &connection) {
       SSL_set_tlsext_host_name(connection->socket->native_handle(), this->host.c_str());
+      if(tls_session) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+        // Offer a copy so that dropping this connection does not invalidate the stored session
+        if(auto copy = SSL_SESSION_dup(tls_session.get())) {
+          SSL_set_session(connection->socket->native_handle(), copy);
+          SSL_SESSION_free(copy);
+        }
+#else
+        SSL_set_session(connection->socket->native_handle(), tls_session.get());
+#endif
+      }
 
       connection->set_timeout(this->config.timeout_request);
       connection->socket->async_handshake(asio::ssl::stream_base::client, [this, connection](const error_code &ec) {
@@ -141,10 +210,15 @@ namespace SimpleWeb {
         auto lock = connection->handler_runner->continue_lock();
         if(!lock)
           return;
-        if(!ec)
+        if(!ec) {
+          connection->timing.handshaken = std::chrono::steady_clock::now();
+          connection->timing.session_resumed = SSL_session_reused(connection->socket->native_handle()) == 1;
           upgrade(connection);
-        else
+        }
+        else {
+          this->tls_session = nullptr; // Do not offer a session the server may have rejected
           this->connection_error(connection, ec);
+        }
       });
     }
   };
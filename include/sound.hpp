@@ -1,66 +1,255 @@
 #pragma once
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <tuple>
 #include <vector>
-#include <deque>
 #include <mutex>
 #include <string>
 #include <thread>
 #include <chrono> 
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
 #include <portaudio.h>
 #include <algorithm>
 #include <portaudio.h>
 #include <miniaudio.h>
+#include "resampler.hpp"
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 using audioCallback = void (*)(void *pUserData, 
                     void *pOutput, 
                     const void *pInput, 
                     ma_uint32 frameCount);
 
+// Device tuning profile, the "audio" object of localai.json
+struct AudioTuning
+{
+    int period_ms = 0;       // callback period, 0 uses frames_per_buffer
+    int periods = 0;         // periods in the device buffer, 0 leaves it to miniaudio
+    bool mmap = true;        // allow ALSA mmap transfers, false forces read/write
+    bool low_latency = true; // miniaudio's low-latency performance profile
+    int rt_priority = 0;     // SCHED_FIFO priority of the audio thread, 0 leaves its scheduling alone
+    int cpu = -1;            // core the audio thread is pinned to, -1 for any
+};
+
+// Run time of one registered callback. Counters are written by the audio thread only.
+struct CbStats
+{
+    std::string name;
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> total_ns{0};
+    std::atomic<uint64_t> max_ns{0}; // since the last CbReport()
+    uint64_t last_calls = 0;         // CbReport() side
+    uint64_t last_total_ns = 0;
+};
+
 struct SoundCb
 {
     audioCallback cb;
     void *data;
+    CbStats *stats;
 };
 
 class SoundDev
 {
+    // Callback lists are immutable once published. AddCb/RemoveCb build a new one, swap it in
+    // and free the old one after the grace period, so Dispatch() never locks or waits.
+    struct CbList
+    {
+        std::vector<SoundCb> cbs;
+    };
+    std::atomic<const CbList *> cbs_;
+    std::atomic<uint64_t> dispatch_seq_{0}; // odd while Dispatch() runs
+    std::atomic<uint64_t> audio_ns_{0};     // audio dispatched, for the budget share
+    uint64_t last_audio_ns_ = 0;
+    std::mutex cbs_mutex_; // AddCb/RemoveCb/CbReport
+    std::vector<std::unique_ptr<CbStats>> cb_stats_;
+
+    // Swaps in list and frees the previous one once no Dispatch() can still be reading it.
+    // cbs_mutex_ held; never call from a callback.
+    void Publish(const CbList *list)
+    {
+        const CbList *old = cbs_.exchange(list);
+        uint64_t seq = dispatch_seq_.load();
+        while ((seq & 1) && dispatch_seq_.load() == seq)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        delete old;
+    }
+
 protected:
-    std::vector<SoundCb> cbs;
     PaStream *stream;
 public:
     int sample_rate;
     uint32_t sample_format;
     int frames_per_buffer;
     int channels;
+    AudioTuning tuning;    // applied by Open()
+    double open_ms = 0;    // time Open() took
+    double latency_ms = 0; // device buffering negotiated by Open(): period size x periods
+    std::string report;    // what Open() negotiated, for the start-up log
 
 public:
     SoundDev(int sample_rate, uint32_t sample_format, int frames_per_buffer, int channels)
-        : sample_rate(sample_rate), sample_format(sample_format), frames_per_buffer(frames_per_buffer), channels(channels) {}
-    virtual ~SoundDev() {}
+        : cbs_(new CbList), sample_rate(sample_rate), sample_format(sample_format), frames_per_buffer(frames_per_buffer), channels(channels) {}
+    SoundDev(const SoundDev &) = delete;
+    SoundDev &operator=(const SoundDev &) = delete;
+    virtual ~SoundDev()
+    {
+        delete cbs_.load();
+    }
     static void AudioCallback(ma_device *pDevice, 
                     void *pOutput, 
                     const void *pInput, 
                     ma_uint32 frameCount)
     {
-        SoundDev *pSoundDev = static_cast<SoundDev *>(pDevice->pUserData);
-        for (const auto &cb : pSoundDev->cbs)
+        static_cast<SoundDev *>(pDevice->pUserData)->Dispatch(pOutput, pInput, frameCount);
+    }
+    // Runs every registered callback on one period of audio and times each of them.
+    // Audio thread only: wait-free, no locks, no allocation.
+    void Dispatch(void *pOutput, const void *pInput, ma_uint32 frameCount)
+    {
+        dispatch_seq_.fetch_add(1); // seq_cst, pairs with Publish()
+        const CbList *list = cbs_.load();
+        for (const auto &cb : list->cbs)
         {
+            auto start = std::chrono::steady_clock::now();
             cb.cb(cb.data, pOutput, pInput, frameCount);
+            uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            CbStats &stats = *cb.stats;
+            stats.calls.store(stats.calls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            stats.total_ns.store(stats.total_ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+            if (ns > stats.max_ns.load(std::memory_order_relaxed))
+                stats.max_ns.store(ns, std::memory_order_relaxed);
+        }
+        if (sample_rate > 0)
+            audio_ns_.store(audio_ns_.load(std::memory_order_relaxed) + frameCount * 1000000000ull / sample_rate, std::memory_order_relaxed);
+        dispatch_seq_.fetch_add(1, std::memory_order_release);
+    }
+    static double LatencyMs(ma_uint32 period_frames, ma_uint32 periods, ma_uint32 rate)
+    {
+        return rate > 0 ? 1000.0 * period_frames * periods / rate : 0;
+    }
+    // Period and buffer settings of the tuning profile, before ma_device_init()
+    void ApplyTuning(ma_device_config &config) const
+    {
+        config.periodSizeInFrames = tuning.period_ms > 0 ? sample_rate * tuning.period_ms / 1000 : frames_per_buffer;
+        config.periods = tuning.periods;
+        config.performanceProfile = tuning.low_latency ? ma_performance_profile_low_latency : ma_performance_profile_conservative;
+        config.alsa.noMMap = !tuning.mmap;
+    }
+    // Scheduling of the device thread, e.g. ma_device::thread after ma_device_init(). Failures
+    // (no CAP_SYS_NICE) leave the thread as it was and show up in Describe().
+    static void TuneThread(pthread_t thread, const AudioTuning &tuning)
+    {
+        if (tuning.rt_priority > 0)
+        {
+            struct sched_param param;
+            param.sched_priority = std::min(tuning.rt_priority, sched_get_priority_max(SCHED_FIFO));
+            pthread_setschedparam(thread, SCHED_FIFO, &param);
+        }
+        if (tuning.cpu >= 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(tuning.cpu, &set);
+            pthread_setaffinity_np(thread, sizeof(set), &set);
         }
     }
-    void AddCb(audioCallback cb, void *data)
+    // One side of an opened device as negotiated, and the scheduling its thread really got
+    static std::string Describe(const char *backend, pthread_t thread, ma_uint32 period, ma_uint32 periods, ma_uint32 rate, bool mmap)
     {
-        cbs.push_back({cb, data});
+        int policy = 0;
+        struct sched_param param;
+        param.sched_priority = 0;
+        pthread_getschedparam(thread, &policy, &param);
+        std::string cpus;
+        cpu_set_t set;
+        if (pthread_getaffinity_np(thread, sizeof(set), &set) == 0 && CPU_COUNT(&set) < sysconf(_SC_NPROCESSORS_ONLN))
+        {
+            for (int i = 0; i < CPU_SETSIZE; i++)
+                if (CPU_ISSET(i, &set))
+                    cpus += (cpus.empty() ? "" : ",") + std::to_string(i);
+        }
+        char text[256];
+        snprintf(text, sizeof(text), "%s, period %u frames x %u at %u Hz = %.1f ms, %s, %s %d, cpu %s",
+                 backend, period, periods, rate, LatencyMs(period, periods, rate),
+                 mmap ? "mmap" : "read/write", policy == SCHED_FIFO ? "SCHED_FIFO" : policy == SCHED_RR ? "SCHED_RR" : "SCHED_OTHER",
+                 param.sched_priority, cpus.empty() ? "any" : cpus.c_str());
+        return text;
     }
-    void RemoveCb(audioCallback cb)
+    // Safe while the device runs; name labels the callback in CbReport()
+    void AddCb(audioCallback cb, void *data, const char *name = nullptr)
     {
-        cbs.erase(
-            std::remove_if(cbs.begin(), cbs.end(),
-                           [cb](const SoundCb &scb)
-                           { return scb.cb == cb; }),
-            cbs.end());
+        std::lock_guard<std::mutex> lock(cbs_mutex_);
+        CbStats *stats = new CbStats;
+        stats->name = name ? name : "cb" + std::to_string(cb_stats_.size());
+        cb_stats_.emplace_back(stats);
+        CbList *list = new CbList(*cbs_.load());
+        list->cbs.push_back({cb, data, stats});
+        Publish(list);
+    }
+    // Removes cb (only the one registered with data, if given). Safe while the device runs;
+    // once it returns the callback is no longer running and won't be called again.
+    void RemoveCb(audioCallback cb, void *data = nullptr)
+    {
+        std::lock_guard<std::mutex> lock(cbs_mutex_);
+        CbList *list = new CbList(*cbs_.load());
+        std::vector<CbStats *> removed;
+        list->cbs.erase(
+            std::remove_if(list->cbs.begin(), list->cbs.end(),
+                           [&](const SoundCb &scb)
+                           {
+                               bool match = scb.cb == cb && (data == nullptr || scb.data == data);
+                               if (match)
+                                   removed.push_back(scb.stats);
+                               return match;
+                           }),
+            list->cbs.end());
+        Publish(list);
+        cb_stats_.erase(
+            std::remove_if(cb_stats_.begin(), cb_stats_.end(),
+                           [&](const std::unique_ptr<CbStats> &stats)
+                           { return std::find(removed.begin(), removed.end(), stats.get()) != removed.end(); }),
+            cb_stats_.end());
+    }
+    // Share of the audio time each callback took since the last call, with its average and
+    // worst run, e.g. "mixer 1.20% (avg 4.1 us, max 38.0 us)"
+    std::string CbReport()
+    {
+        std::lock_guard<std::mutex> lock(cbs_mutex_);
+        uint64_t audio_ns = audio_ns_.load(std::memory_order_relaxed);
+        uint64_t span_ns = audio_ns - last_audio_ns_;
+        last_audio_ns_ = audio_ns;
+        std::string text;
+        for (auto &stats : cb_stats_)
+        {
+            uint64_t calls = stats->calls.load(std::memory_order_relaxed);
+            uint64_t total_ns = stats->total_ns.load(std::memory_order_relaxed);
+            uint64_t n = calls - stats->last_calls;
+            uint64_t ns = total_ns - stats->last_total_ns;
+            stats->last_calls = calls;
+            stats->last_total_ns = total_ns;
+            char item[128];
+            snprintf(item, sizeof(item), "%s %.2f%% (avg %.1f us, max %.1f us)", stats->name.c_str(),
+                     span_ns > 0 ? 100.0 * ns / span_ns : 0, n > 0 ? ns / 1000.0 / n : 0,
+                     stats->max_ns.exchange(0, std::memory_order_relaxed) / 1000.0);
+            text += (text.empty() ? "" : ", ") + std::string(item);
+        }
+        return text.empty() ? "none" : text;
     }
     virtual int Open()
     {
@@ -83,34 +272,535 @@ public:
 };
 
 
-class AudioQueue
+// Lock-free single-producer/single-consumer PCM ring for handing audio across the audio
+// callback boundary without locks or allocation. Capacity, reads and writes are whole frames.
+class PcmRing
+{
+public:
+    enum Overflow
+    {
+        DropNewest, // Write what fits and drop the rest
+        Reject,     // Write nothing unless all of it fits
+    };
+
+private:
+    std::vector<uint8_t> buffer_;
+    size_t frame_bytes_;
+    Overflow overflow_;
+    std::atomic<size_t> head_; // advanced by the consumer
+    char pad_[64];             // keeps head_ and tail_ on separate cache lines
+    std::atomic<size_t> tail_; // advanced by the producer
+    bool starved_ = true;                  // consumer only
+
+    size_t Frames(size_t bytes) const
+    {
+        return bytes / frame_bytes_ * frame_bytes_;
+    }
+
+public:
+    std::atomic<uint64_t> overruns;  // bytes the producer dropped because the ring was full
+    std::atomic<uint64_t> underruns; // times the consumer ran dry after having data
+    std::atomic<size_t> max_depth;   // high watermark of size(), in bytes
+
+    PcmRing(size_t capacity_bytes, size_t frame_bytes = 1, Overflow overflow = DropNewest)
+        : frame_bytes_(frame_bytes), overflow_(overflow), head_(0), tail_(0), overruns(0), underruns(0), max_depth(0)
+    {
+        buffer_.resize(std::max(Frames(capacity_bytes), frame_bytes));
+    }
+
+    size_t capacity() const
+    {
+        return buffer_.size();
+    }
+
+    size_t frame_bytes() const
+    {
+        return frame_bytes_;
+    }
+
+    // Bytes queued. Exact on either side, a snapshot anywhere else.
+    size_t size() const
+    {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+    }
+
+    // Producer only. Contiguous free space to write into directly, finish with commit_write().
+    size_t write_region(uint8_t **region)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t space = capacity() - (tail - head_.load(std::memory_order_acquire));
+        size_t pos = tail % capacity();
+        *region = buffer_.data() + pos;
+        return std::min(space, capacity() - pos);
+    }
+
+    void commit_write(size_t size)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed) + Frames(size);
+        tail_.store(tail, std::memory_order_release);
+        size_t depth = tail - head_.load(std::memory_order_acquire);
+        if (depth > max_depth.load(std::memory_order_relaxed))
+        {
+            max_depth.store(depth, std::memory_order_relaxed);
+        }
+    }
+
+    // Consumer only. Contiguous queued data to read directly, finish with commit_read().
+    size_t read_region(const uint8_t **region)
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        size_t available = tail_.load(std::memory_order_acquire) - head;
+        size_t pos = head % capacity();
+        *region = buffer_.data() + pos;
+        return std::min(available, capacity() - pos);
+    }
+
+    void commit_read(size_t size)
+    {
+        head_.store(head_.load(std::memory_order_relaxed) + Frames(size), std::memory_order_release);
+    }
+
+    // Producer only. Returns the bytes written, whole frames, according to the overflow policy.
+    size_t write(const void *data, size_t size)
+    {
+        size = Frames(size);
+        size_t space = capacity() - size_t(tail_.load(std::memory_order_relaxed) - head_.load(std::memory_order_acquire));
+        size_t accepted = size <= space ? size : (overflow_ == Reject ? 0 : space);
+        if (accepted < size)
+        {
+            overruns.fetch_add(size - accepted, std::memory_order_relaxed);
+        }
+        size_t written = 0;
+        uint8_t *region;
+        while (written < accepted)
+        {
+            size_t n = std::min(write_region(&region), accepted - written);
+            memcpy(region, (const uint8_t *)data + written, n);
+            commit_write(n);
+            written += n;
+        }
+        return written;
+    }
+
+    // Consumer only. Copies up to size bytes, whole frames, and returns how many were read.
+    size_t read(void *data, size_t size)
+    {
+        size = Frames(size);
+        size_t done = 0;
+        const uint8_t *region;
+        size_t n;
+        while (done < size && (n = std::min(read_region(&region), size - done)) > 0)
+        {
+            memcpy((uint8_t *)data + done, region, n);
+            commit_read(n);
+            done += n;
+        }
+        account_read(size, done);
+        return done;
+    }
+
+    // Consumer only. Records a read of size bytes that delivered done, for callers using read_region().
+    void account_read(size_t size, size_t done)
+    {
+        if (done < size && !starved_)
+        {
+            underruns.fetch_add(1, std::memory_order_relaxed);
+        }
+        starved_ = done < size;
+    }
+};
+
+// A named input of PcmMixer. Its producer writes into ring, the mixer drains it in the playback callback.
+struct MixerSource
+{
+    std::string name;
+    PcmRing ring;
+    int priority;                 // While this source has audio, sources with a lower priority are ducked
+    std::atomic<float> gain;      // Linear gain
+    std::atomic<float> duck_gain; // Extra gain applied while ducked
+    float applied_gain;           // Mixer only: gain at the end of the last buffer, ramped from to avoid clicks
+    std::atomic<bool> flushing;   // Set by Flush(), cleared by the mixer once faded out
+    std::atomic<int64_t> flushed_ns; // steady_clock time the last flush went silent
+
+    MixerSource(const std::string &name, size_t capacity_bytes, size_t frame_bytes, int priority, float gain, float duck_gain)
+        : name(name), ring(capacity_bytes, frame_bytes), priority(priority), gain(gain), duck_gain(duck_gain), applied_gain(gain),
+          flushing(false), flushed_ns(0) {}
+
+    // Fades out over the next device buffer and drops everything queued. The producer must
+    // stop writing first, or the mixer may keep part of what it writes meanwhile.
+    void Flush()
+    {
+        flushing.store(true, std::memory_order_release);
+    }
+};
+
+// Sums any number of MixerSource rings into a device buffer, filling the rest with silence.
+// f32 and s16 are mixed; other formats play only the highest priority source.
+class PcmMixer
+{
+public:
+    static const int MaxSources = 8;
+
+private:
+    ma_format format_;
+    size_t frame_bytes_;
+    size_t samples_per_frame_;
+    std::mutex add_mutex_;
+    std::unique_ptr<MixerSource> owned_[MaxSources];
+    std::atomic<MixerSource *> sources_[MaxSources]; // read lock-free by Mix()
+
+    static void FinishFlush(MixerSource *source)
+    {
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        source->flushed_ns.store(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count(), std::memory_order_relaxed);
+        source->flushing.store(false, std::memory_order_release);
+    }
+
+    // out[i] += in[i] * gain, gain ramping linearly from g0 to g1 over n samples
+    static void MixF32(float *out, const float *in, size_t n, float g0, float g1)
+    {
+        size_t i = 0;
+        if (g0 == g1)
+        {
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+            float32x4_t g = vdupq_n_f32(g0);
+            for (; i + 4 <= n; i += 4)
+                vst1q_f32(out + i, vmlaq_f32(vld1q_f32(out + i), vld1q_f32(in + i), g));
+#elif defined(__SSE2__)
+            __m128 g = _mm_set1_ps(g0);
+            for (; i + 4 <= n; i += 4)
+                _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(_mm_loadu_ps(in + i), g)));
+#endif
+        }
+        float step = n > 0 ? (g1 - g0) / n : 0;
+        for (; i < n; i++)
+            out[i] += in[i] * (g0 + step * i);
+    }
+
+    // out[i] = saturate(out[i] + in[i] * gain), gain ramping linearly from g0 to g1 over n samples.
+    // Gains above 1 are clamped.
+    static void MixS16(int16_t *out, const int16_t *in, size_t n, float g0, float g1)
+    {
+        g0 = std::min(g0, 1.0f);
+        g1 = std::min(g1, 1.0f);
+        size_t i = 0;
+        if (g0 == g1 && g0 >= 1.0f)
+        {
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+            for (; i + 8 <= n; i += 8)
+                vst1q_s16(out + i, vqaddq_s16(vld1q_s16(out + i), vld1q_s16(in + i)));
+#elif defined(__SSE2__)
+            for (; i + 8 <= n; i += 8)
+                _mm_storeu_si128((__m128i *)(out + i), _mm_adds_epi16(_mm_loadu_si128((const __m128i *)(out + i)), _mm_loadu_si128((const __m128i *)(in + i))));
+#endif
+        }
+        else if (g0 == g1)
+        {
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+            int16x8_t g = vdupq_n_s16((int16_t)(std::max(g0, 0.0f) * 32768.0f)); // Q15
+            for (; i + 8 <= n; i += 8)
+                vst1q_s16(out + i, vqaddq_s16(vld1q_s16(out + i), vqrdmulhq_s16(vld1q_s16(in + i), g)));
+#elif defined(__SSSE3__)
+            __m128i g = _mm_set1_epi16((int16_t)(std::max(g0, 0.0f) * 32768.0f)); // Q15
+            for (; i + 8 <= n; i += 8)
+                _mm_storeu_si128((__m128i *)(out + i), _mm_adds_epi16(_mm_loadu_si128((const __m128i *)(out + i)), _mm_mulhrs_epi16(_mm_loadu_si128((const __m128i *)(in + i)), g)));
+#endif
+        }
+        float step = n > 0 ? (g1 - g0) / n : 0;
+        for (; i < n; i++)
+        {
+            int32_t v = out[i] + (int32_t)(in[i] * (g0 + step * i));
+            out[i] = (int16_t)std::min(std::max(v, -32768), 32767);
+        }
+    }
+
+public:
+    PcmMixer(ma_format format, int channels)
+        : format_(format), frame_bytes_(ma_get_bytes_per_frame(format, channels)), samples_per_frame_(channels)
+    {
+        for (auto &source : sources_)
+        {
+            source.store(nullptr);
+        }
+    }
+
+    // Adds a source with room for capacity_bytes of audio. Safe while the device runs;
+    // sources live as long as the mixer. Returns nullptr when all slots are taken.
+    MixerSource *AddSource(const std::string &name, size_t capacity_bytes, int priority = 0, float gain = 1.0f, float duck_gain = 0.3f)
+    {
+        std::lock_guard<std::mutex> lock(add_mutex_);
+        for (int i = 0; i < MaxSources; i++)
+        {
+            if (!owned_[i])
+            {
+                owned_[i].reset(new MixerSource(name, capacity_bytes, frame_bytes_, priority, gain, duck_gain));
+                sources_[i].store(owned_[i].get(), std::memory_order_release);
+                return owned_[i].get();
+            }
+        }
+        return nullptr;
+    }
+
+    MixerSource *Find(const std::string &name)
+    {
+        std::lock_guard<std::mutex> lock(add_mutex_);
+        for (int i = 0; i < MaxSources; i++)
+        {
+            if (owned_[i] && owned_[i]->name == name)
+            {
+                return owned_[i].get();
+            }
+        }
+        return nullptr;
+    }
+
+    // Playback callback only: no locks, no allocation.
+    void Mix(void *output, ma_uint32 frameCount)
+    {
+        size_t bytes = frameCount * frame_bytes_;
+        memset(output, 0, bytes);
+
+        MixerSource *active[MaxSources];
+        int count = 0;
+        int top = INT32_MIN;
+        for (auto &slot : sources_)
+        {
+            MixerSource *source = slot.load(std::memory_order_acquire);
+            if (source == nullptr)
+                continue;
+            if (source->ring.size() == 0)
+            {
+                source->ring.account_read(bytes, 0);
+                // Restart at full level next time instead of fading in
+                source->applied_gain = source->gain.load(std::memory_order_relaxed);
+                if (source->flushing.load(std::memory_order_acquire))
+                    FinishFlush(source);
+                continue;
+            }
+            active[count++] = source;
+            top = std::max(top, source->priority);
+        }
+
+        bool mixable = format_ == ma_format_f32 || format_ == ma_format_s16;
+        for (int s = 0; s < count; s++)
+        {
+            MixerSource *source = active[s];
+            if (!mixable && source->priority != top)
+                continue;
+            float target = source->gain.load(std::memory_order_relaxed);
+            if (source->priority < top)
+                target *= source->duck_gain.load(std::memory_order_relaxed);
+            bool flushing = source->flushing.load(std::memory_order_acquire);
+            if (flushing)
+                target = 0;
+            float g0 = source->applied_gain;
+
+            size_t done = 0;
+            const uint8_t *region;
+            size_t n;
+            while (done < bytes && (n = std::min(source->ring.read_region(&region), bytes - done)) > 0)
+            {
+                float from = g0 + (target - g0) * done / bytes;
+                float to = g0 + (target - g0) * (done + n) / bytes;
+                uint8_t *out = (uint8_t *)output + done;
+                if (format_ == ma_format_f32)
+                    MixF32((float *)out, (const float *)region, n / sizeof(float), from, to);
+                else if (format_ == ma_format_s16)
+                    MixS16((int16_t *)out, (const int16_t *)region, n / sizeof(int16_t), from, to);
+                else
+                    memcpy(out, region, n);
+                source->ring.commit_read(n);
+                done += n;
+            }
+            source->ring.account_read(bytes, done);
+            source->applied_gain = target;
+            if (flushing)
+            {
+                source->ring.commit_read(source->ring.size());
+                source->applied_gain = source->gain.load(std::memory_order_relaxed);
+                FinishFlush(source);
+            }
+            if (!mixable)
+                break;
+        }
+    }
+};
+
+
+// Smooths bursty network audio in front of a playback ring. Playback is held back until
+// TargetMs() of audio is queued, at every Start() and after every underrun, and the target
+// follows the measured arrival jitter. Producer side only.
+class JitterBuffer
+{
+private:
+    PcmRing &ring_;
+    double bytes_per_ms_;
+    std::vector<uint8_t> staged_; // held back while prebuffering
+    bool buffering_ = true;
+    uint64_t ring_underruns_ = 0; // ring_.underruns when playback was last released
+    bool have_last_ = false;
+    std::chrono::steady_clock::time_point last_arrival_;
+    double last_duration_ms_ = 0;
+    double last_queued_ms_ = 0; // audio queued right after the previous packet
+
+    void Release()
+    {
+        ring_.write(staged_.data(), staged_.size());
+        staged_.clear();
+        buffering_ = false;
+        ring_underruns_ = ring_.underruns.load(std::memory_order_relaxed);
+    }
+
+public:
+    int min_ms = 60;      // prebuffer at sentence start, and the floor of the adaptive target
+    int max_ms = 400;     // ceiling of the adaptive target
+    double jitter_ms = 0; // smoothed lateness of packets relative to the audio they carry
+    uint64_t packets = 0;
+    uint64_t late_packets = 0; // arrived after the audio queued before them had run out
+    uint64_t underruns = 0;    // times playback ran dry mid-sentence
+
+    JitterBuffer(PcmRing &ring, int sample_rate)
+        : ring_(ring), bytes_per_ms_(sample_rate * ring.frame_bytes() / 1000.0)
+    {
+        staged_.reserve(ring.capacity());
+    }
+
+    int TargetMs() const
+    {
+        return std::min(max_ms, std::max(min_ms, (int)(min_ms + 4 * jitter_ms)));
+    }
+
+    // A new sentence: prebuffer again and do not count the pause before it as jitter.
+    void Start()
+    {
+        Flush();
+        buffering_ = true;
+        have_last_ = false;
+    }
+
+    void Push(const void *data, size_t size)
+    {
+        auto now = std::chrono::steady_clock::now();
+        packets++;
+        if (have_last_)
+        {
+            double gap = std::chrono::duration<double, std::milli>(now - last_arrival_).count();
+            // RFC 3550 style estimate, counting only packets later than the audio before them lasted
+            jitter_ms += (std::max(gap - last_duration_ms_, 0.0) - jitter_ms) / 16;
+            if (!buffering_ && gap > last_queued_ms_)
+            {
+                late_packets++;
+            }
+        }
+        have_last_ = true;
+        last_arrival_ = now;
+        last_duration_ms_ = size / bytes_per_ms_;
+
+        if (!buffering_ && ring_.underruns.load(std::memory_order_relaxed) != ring_underruns_)
+        {
+            underruns++;
+            buffering_ = true;
+        }
+        if (buffering_)
+        {
+            staged_.insert(staged_.end(), (const uint8_t *)data, (const uint8_t *)data + size);
+            if (ring_.size() + staged_.size() >= TargetMs() * bytes_per_ms_)
+            {
+                Release();
+            }
+        }
+        else
+        {
+            ring_.write(data, size);
+        }
+        last_queued_ms_ = ring_.size() / bytes_per_ms_;
+    }
+
+    // End of a sentence: play whatever is held back.
+    void Flush()
+    {
+        if (!staged_.empty())
+        {
+            Release();
+        }
+    }
+
+    // Interrupted: forget what is held back and prebuffer the next sentence from scratch.
+    void Drop()
+    {
+        staged_.clear();
+        buffering_ = true;
+        have_last_ = false;
+    }
+};
+
+// Keeps the most recent capture while the uplink is closed, so that what was said before it
+// opened can be sent ahead of the live audio. Storage is allocated once. Single-threaded.
+class PrerollBuffer
 {
 private:
-    std::mutex mutex_;
-    std::deque<uint8_t> audio_queue_;
-    int max_size = 100 * 1024; // Default max size of 100 KB
+    PcmRing ring_;
+    double bytes_per_ms_;
 
 public:
+    uint64_t drains = 0;   // times it was handed on with audio in it
+    double drained_ms = 0; // audio handed on
 
-    AudioQueue() {}
-    ~AudioQueue() {}
+    PrerollBuffer(int ms, int sample_rate, size_t frame_bytes)
+        : ring_(std::max<size_t>(1, (size_t)sample_rate * ms / 1000) * frame_bytes, frame_bytes),
+          bytes_per_ms_(sample_rate * frame_bytes / 1000.0) {}
 
-    void push(const std::vector<uint8_t> &audio)
+    double ms() const
     {
-        std::lock_guard<std::mutex> lock(mutex_);
-        audio_queue_.insert(audio_queue_.end(), audio.begin(), audio.end());
+        return ring_.size() / bytes_per_ms_;
     }
 
-    std::vector<uint8_t> pop_front(size_t size = 1024)
+    size_t size() const
     {
-        std::lock_guard<std::mutex> lock(mutex_);
-        if (audio_queue_.size() < size)
+        return ring_.size();
+    }
+
+    // Appends audio, dropping the oldest to make room
+    void Keep(const void *data, size_t size)
+    {
+        if (size > ring_.capacity())
         {
-            size = audio_queue_.size();
+            data = (const uint8_t *)data + size - ring_.capacity();
+            size = ring_.capacity();
         }
-        std::vector<uint8_t> audio(audio_queue_.begin(), audio_queue_.begin() + size);
-        audio_queue_.erase(audio_queue_.begin(), audio_queue_.begin() + size);
-        return audio;
+        if (ring_.size() + size > ring_.capacity())
+        {
+            ring_.commit_read(ring_.size() + size - ring_.capacity());
+        }
+        ring_.write(data, size);
+    }
+
+    // Hands everything kept to send(const uint8_t *data, size_t size), oldest first and at most
+    // max_bytes at a time, and empties the buffer. Returns the bytes handed on.
+    template <class Send>
+    size_t Drain(size_t max_bytes, Send send)
+    {
+        max_bytes = std::max(max_bytes / ring_.frame_bytes() * ring_.frame_bytes(), ring_.frame_bytes());
+        size_t done = 0;
+        const uint8_t *region;
+        size_t n;
+        while ((n = std::min(ring_.read_region(&region), max_bytes)) > 0)
+        {
+            send(region, n);
+            ring_.commit_read(n);
+            done += n;
+        }
+        if (done > 0)
+        {
+            drains++;
+            drained_ms += done / bytes_per_ms_;
+        }
+        return done;
+    }
+
+    void Clear()
+    {
+        ring_.commit_read(ring_.size());
     }
 };
 
@@ -125,6 +815,16 @@ private:
     int outFormat;
     int outSampleRate;
     int outChannels;
+    std::unique_ptr<Resampler> fast; // integer-ratio kernel, used instead of converter when set
+
+    ma_result Process(const void *in, ma_uint64 *inFrameCount, void *out, ma_uint64 *outFrameCount)
+    {
+        if (fast) {
+            fast->Process(in, inFrameCount, out, outFrameCount);
+            return MA_SUCCESS;
+        }
+        return ma_data_converter_process_pcm_frames(&converter, in, inFrameCount, out, outFrameCount);
+    }
 public:
     PcmConverter(int inFormat, int inSampleRate, int inChannels,
                    int outFormat, int outSampleRate, int outChannels)
@@ -137,6 +837,7 @@ public:
         if (ma_data_converter_init(&config, NULL, &converter) != MA_SUCCESS) {
             throw std::runtime_error("Failed to initialize PCM converter");
         }
+        fast = CreateResampler(inFormat, inSampleRate, inChannels, outFormat, outSampleRate, outChannels);
     }
     ~PcmConverter()
     {
@@ -146,29 +847,64 @@ public:
     {
         return ma_get_bytes_per_frame((ma_format)format, channels);
     }
-    std::vector<uint8_t> Convert(const void*data, size_t size)
+    PcmConverter(const PcmConverter &) = delete;
+    PcmConverter &operator=(const PcmConverter &) = delete;
+    // Upper bound of the bytes Convert() produces from size input bytes
+    size_t MaxOutputBytes(size_t size) const
+    {
+        ma_uint64 inFrameCount = size / GetBytesPerFrame(inFormat, inChannels);
+        return (inFrameCount * outSampleRate / inSampleRate + 1) * GetBytesPerFrame(outFormat, outChannels);
+    }
+    // Converts into out, keeping the resampler state for the next chunk. Returns the bytes written.
+    size_t Convert(const void *data, size_t size, void *out, size_t out_size)
     {
         if (data == nullptr || size == 0) {
-            return {};
+            return 0;
         }
-        size_t inFrameSize = GetBytesPerFrame(inFormat, inChannels);
         size_t outFrameSize = GetBytesPerFrame(outFormat, outChannels);
-        ma_uint64 inFrameCount = size / inFrameSize;
-        ma_uint64 outFrameCount = inFrameCount * outSampleRate / inSampleRate + 1;
-        std::vector<uint8_t> outputData(outFrameCount * outFrameSize);
-        ma_uint64 framesConverted = outFrameCount;
-        
-        ma_result result = ma_data_converter_process_pcm_frames(
-            &converter,
-            data, &inFrameCount,
-            outputData.data(), &framesConverted);
-
-        if (result != MA_SUCCESS) {
+        ma_uint64 inFrameCount = size / GetBytesPerFrame(inFormat, inChannels);
+        ma_uint64 framesConverted = out_size / outFrameSize;
+        if (Process(data, &inFrameCount, out, &framesConverted) != MA_SUCCESS) {
             printf("PCM conversion failed\n");
-            outputData.clear();
-        } else {
-            outputData.resize(framesConverted * outFrameSize);
+            return 0;
         }
+        return framesConverted * outFrameSize;
+    }
+    // Converts straight into the free space of ring. Output that does not fit is dropped
+    // and counted in ring.overruns. Returns the bytes written.
+    size_t Convert(const void *data, size_t size, PcmRing &ring)
+    {
+        size_t inFrameSize = GetBytesPerFrame(inFormat, inChannels);
+        size_t outFrameSize = GetBytesPerFrame(outFormat, outChannels);
+        const uint8_t *in = (const uint8_t *)data;
+        size_t written = 0;
+        while (size >= inFrameSize) {
+            uint8_t *region;
+            size_t space = ring.write_region(&region);
+            if (space < outFrameSize) {
+                ring.overruns.fetch_add(MaxOutputBytes(size), std::memory_order_relaxed);
+                break;
+            }
+            ma_uint64 inFrameCount = size / inFrameSize;
+            ma_uint64 framesConverted = space / outFrameSize;
+            if (Process(in, &inFrameCount, region, &framesConverted) != MA_SUCCESS) {
+                printf("PCM conversion failed\n");
+                break;
+            }
+            ring.commit_write(framesConverted * outFrameSize);
+            written += framesConverted * outFrameSize;
+            in += inFrameCount * inFrameSize;
+            size -= inFrameCount * inFrameSize;
+            if (inFrameCount == 0 && framesConverted == 0) {
+                break;
+            }
+        }
+        return written;
+    }
+    std::vector<uint8_t> Convert(const void*data, size_t size)
+    {
+        std::vector<uint8_t> outputData(MaxOutputBytes(size));
+        outputData.resize(Convert(data, size, outputData.data(), outputData.size()));
         return outputData;
     }
     std::vector<uint8_t> Convert(const std::vector<uint8_t> &inputData)
@@ -181,11 +917,39 @@ class PlayDev : public SoundDev
 {
     ma_device device;
     ma_context context;
-    AudioQueue audio_queue_;
+    PcmMixer mixer_{(ma_format)sample_format, channels};
+    MixerSource *local_ = mixer_.AddSource("local", (size_t)sample_rate * 10 * BytesPerFrame(), 1); // 10 s, ducks TTS
+    // Play() converters by input (format, rate, channels), kept so resampler state carries across chunks
+    std::map<std::tuple<uint32_t, int, int>, std::unique_ptr<PcmConverter>> converters_;
+    // Copy of the mixed output for echo cancellation, see AddReference()
+    std::unique_ptr<PcmRing> reference_owner_;
+    std::atomic<PcmRing *> reference_{nullptr};
 public:
     using SoundDev::SoundDev;
+    // Adds a named input to the playback mix, see PcmMixer::AddSource()
+    MixerSource *AddSource(const std::string &name, size_t capacity_bytes, int priority = 0, float gain = 1.0f, float duck_gain = 0.3f)
+    {
+        return mixer_.AddSource(name, capacity_bytes, priority, gain, duck_gain);
+    }
+    MixerSource *FindSource(const std::string &name)
+    {
+        return mixer_.Find(name);
+    }
+    // Returns a ring that receives every frame handed to the device, in the device format,
+    // as the echo reference. Created on the first call; the reader must keep up or the
+    // newest audio is dropped.
+    PcmRing *AddReference(size_t capacity_bytes)
+    {
+        if (!reference_owner_)
+        {
+            reference_owner_.reset(new PcmRing(capacity_bytes, BytesPerFrame()));
+            reference_.store(reference_owner_.get(), std::memory_order_release);
+        }
+        return reference_owner_.get();
+    }
     virtual int Open() override
     {
+        auto start = std::chrono::steady_clock::now();
         ma_backend backends[] = {ma_backend_alsa};
         ma_context_config ctxConfig = ma_context_config_init();
 
@@ -201,6 +965,7 @@ public:
         devConfig.sampleRate = sample_rate;
         devConfig.dataCallback = AudioCallback; // Set your callback function
         devConfig.pUserData = this; // Pass pointer to your audio queue if needed
+        ApplyTuning(devConfig);
 
         if (ma_device_init(&context, &devConfig, &device) != MA_SUCCESS)
         {
@@ -208,6 +973,7 @@ public:
             ma_context_uninit(&context);
             return -1;
         }
+        TuneThread(device.thread, tuning);
         if (ma_device_start(&device) != MA_SUCCESS)
         {
             printf("Failed to start playback device\n");
@@ -216,7 +982,11 @@ public:
             return -1;
         }
 
-        AddCb(PlayCb, this); // Register the playback callback
+        AddCb(PlayCb, this, "mixer"); // Register the playback callback
+        latency_ms = LatencyMs(device.playback.internalPeriodSizeInFrames, device.playback.internalPeriods, device.playback.internalSampleRate);
+        report = Describe(ma_get_backend_name(device.pContext->backend), device.thread, device.playback.internalPeriodSizeInFrames, device.playback.internalPeriods,
+                          device.playback.internalSampleRate, device.alsa.isUsingMMapPlayback);
+        open_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
         return 0;
     }
     virtual int Close() override
@@ -232,15 +1002,10 @@ public:
                     ma_uint32 frameCount)
     {
         PlayDev *pPlayDev = static_cast<PlayDev *>(pUserData);
-        std::vector<uint8_t> audioData = pPlayDev->audio_queue_.pop_front(frameCount * pPlayDev->BytesPerFrame());
-        if (!audioData.empty())
+        pPlayDev->mixer_.Mix(pOutput, frameCount);
+        if (PcmRing *reference = pPlayDev->reference_.load(std::memory_order_acquire))
         {
-            memcpy(pOutput, audioData.data(), audioData.size());
-        }
-        else
-        {
-            // Fill with silence if no data available
-            // std::fill((uint8_t *)pOutput, (uint8_t *)pOutput + frameCount * pPlayDev->BytesPerFrame(), 0);
+            reference->write(pOutput, frameCount * pPlayDev->BytesPerFrame());
         }
     }
     void Play(void *data, size_t size)
@@ -249,7 +1014,7 @@ public:
         {
             return;
         }
-        audio_queue_.push(std::vector<uint8_t>((uint8_t *)data, (uint8_t *)data + size));
+        local_->ring.write(data, size);
     }
     void Play(void *data, size_t size, int sample_rate, uint32_t sample_format, int channels)
     {
@@ -258,15 +1023,14 @@ public:
             return;
         }
         // Adjust the playback parameters if needed
-        PcmConverter converter(
-            (int)sample_format, sample_rate, channels,
-            (int)this->sample_format, this->sample_rate, this->channels);
-        std::vector<uint8_t> convertedData = converter.Convert(data, size);
-        if (convertedData.empty())
+        auto &converter = converters_[std::make_tuple(sample_format, sample_rate, channels)];
+        if (!converter)
         {
-            return;
+            converter.reset(new PcmConverter(
+                (int)sample_format, sample_rate, channels,
+                (int)this->sample_format, this->sample_rate, this->channels));
         }
-        audio_queue_.push(convertedData);
+        converter->Convert(data, size, local_->ring);
     }
 };
 
@@ -279,6 +1043,7 @@ public:
     virtual int Open() override
     {
         // Open the recording device
+        auto start = std::chrono::steady_clock::now();
         ma_backend backends[] = {ma_backend_alsa};
         ma_context_config ctxConfig = ma_context_config_init();
         if (ma_context_init(backends, 1, &ctxConfig, &context) != MA_SUCCESS)
@@ -292,12 +1057,14 @@ public:
         devConfig.sampleRate = sample_rate;
         devConfig.dataCallback = AudioCallback; // Set your callback if needed
         devConfig.pUserData = this; // Pass pointer to your audio queue if needed
+        ApplyTuning(devConfig);
         if (ma_device_init(&context, &devConfig, &device) != MA_SUCCESS)
         {
             printf("Failed to open recording device\n");
             ma_context_uninit(&context);
             return -1;
         }
+        TuneThread(device.thread, tuning);
         if (ma_device_start(&device) != MA_SUCCESS)
         {
             printf("Failed to start recording device\n");
@@ -305,6 +1072,10 @@ public:
             ma_context_uninit(&context);
             return -1;
         }
+        latency_ms = LatencyMs(device.capture.internalPeriodSizeInFrames, device.capture.internalPeriods, device.capture.internalSampleRate);
+        report = Describe(ma_get_backend_name(device.pContext->backend), device.thread, device.capture.internalPeriodSizeInFrames, device.capture.internalPeriods,
+                          device.capture.internalSampleRate, device.alsa.isUsingMMapCapture);
+        open_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
         return 0;
     }
     virtual int Close() override
@@ -315,3 +1086,179 @@ public:
         return 0;
     }
 };
+
+// One full-duplex miniaudio device on one context, driving a PlayDev and a RecordDev in place of
+// their own devices. Capture and playback of a period are handled in the same callback off the
+// same clock, so the echo path the AEC sees does not drift. Consumers still register with
+// AddCb() on either side. Each side keeps its own format and channels; the device runs at the
+// higher of the two rates, so capture is never downsampled below what the RecordDev asked for,
+// and the lower side is resampled in the callback. The tuning profile of the PlayDev applies to
+// both sides.
+class DuplexDev
+{
+    PlayDev &play_;
+    RecordDev &record_;
+    ma_context context;
+    ma_device device;
+    bool opened_ = false;
+    int rate_ = 0; // device rate
+    std::unique_ptr<PcmConverter> capture_converter_; // device rate to record_'s
+    std::vector<uint8_t> capture_buf_;
+    std::unique_ptr<PcmConverter> play_converter_; // play_'s rate to the device's
+    std::vector<uint8_t> play_buf_;                // one Dispatch() of play_, before conversion
+    std::vector<uint8_t> play_fifo_;               // converted, not yet played
+    size_t play_fifo_bytes_ = 0;
+
+    // Pulls play_ at its own rate until frameCount device frames are converted
+    void PlayConverted(void *pOutput, ma_uint32 frameCount)
+    {
+        size_t frame_bytes = play_.BytesPerFrame();
+        size_t want = frameCount * frame_bytes;
+        size_t max_frames = play_buf_.size() / frame_bytes;
+        while (play_fifo_bytes_ < want)
+        {
+            size_t missing = (want - play_fifo_bytes_) / frame_bytes;
+            size_t frames = std::min(max_frames, missing * play_.sample_rate / rate_ + 1);
+            memset(play_buf_.data(), 0, frames * frame_bytes);
+            play_.Dispatch(play_buf_.data(), nullptr, frames);
+            play_fifo_bytes_ += play_converter_->Convert(play_buf_.data(), frames * frame_bytes,
+                                                         play_fifo_.data() + play_fifo_bytes_, play_fifo_.size() - play_fifo_bytes_);
+        }
+        memcpy(pOutput, play_fifo_.data(), want);
+        play_fifo_bytes_ -= want;
+        memmove(play_fifo_.data(), play_fifo_.data() + want, play_fifo_bytes_);
+    }
+
+    static void Callback(ma_device *pDevice,
+                    void *pOutput,
+                    const void *pInput,
+                    ma_uint32 frameCount)
+    {
+        DuplexDev *dev = static_cast<DuplexDev *>(pDevice->pUserData);
+        const void *in = pInput;
+        ma_uint32 inFrames = frameCount;
+        if (dev->capture_converter_)
+        {
+            size_t n = dev->capture_converter_->Convert(pInput, frameCount * dev->record_.BytesPerFrame(),
+                                                        dev->capture_buf_.data(), dev->capture_buf_.size());
+            in = dev->capture_buf_.data();
+            inFrames = n / dev->record_.BytesPerFrame();
+        }
+        // Capture first: what the consumers see was recorded while the previous output played
+        if (inFrames > 0)
+        {
+            dev->record_.Dispatch(nullptr, in, inFrames);
+        }
+        if (dev->play_converter_)
+        {
+            dev->PlayConverted(pOutput, frameCount);
+        }
+        else
+        {
+            dev->play_.Dispatch(pOutput, nullptr, frameCount);
+        }
+    }
+
+public:
+    double open_ms = 0; // time Open() took
+
+    DuplexDev(PlayDev &play, RecordDev &record) : play_(play), record_(record) {}
+    DuplexDev(const DuplexDev &) = delete;
+    DuplexDev &operator=(const DuplexDev &) = delete;
+    ~DuplexDev()
+    {
+        Close();
+    }
+
+    int Open()
+    {
+        if (opened_)
+        {
+            return 0;
+        }
+        auto start = std::chrono::steady_clock::now();
+        ma_backend backends[] = {ma_backend_alsa};
+        ma_context_config ctxConfig = ma_context_config_init();
+        if (ma_context_init(backends, 1, &ctxConfig, &context) != MA_SUCCESS)
+        {
+            printf("Failed to initialize miniaudio context\n");
+            return -1;
+        }
+
+        rate_ = std::max(play_.sample_rate, record_.sample_rate);
+        ma_device_config devConfig = ma_device_config_init(ma_device_type_duplex);
+        devConfig.playback.format = (ma_format)play_.sample_format;
+        devConfig.playback.channels = play_.channels;
+        devConfig.capture.format = (ma_format)record_.sample_format;
+        devConfig.capture.channels = record_.channels;
+        devConfig.sampleRate = rate_;
+        devConfig.dataCallback = Callback;
+        devConfig.pUserData = this;
+        play_.ApplyTuning(devConfig);
+        if (play_.tuning.period_ms <= 0)
+        {
+            devConfig.periodSizeInFrames = (ma_uint64)play_.frames_per_buffer * rate_ / play_.sample_rate;
+        }
+        if (ma_device_init(&context, &devConfig, &device) != MA_SUCCESS)
+        {
+            printf("Failed to open duplex device\n");
+            ma_context_uninit(&context);
+            return -1;
+        }
+        SoundDev::TuneThread(device.thread, play_.tuning);
+
+        // Callbacks are one period long; leave room for a few in case the backend batches them
+        ma_uint32 period = std::max(device.playback.internalPeriodSizeInFrames, devConfig.periodSizeInFrames);
+        capture_converter_.reset();
+        play_converter_.reset();
+        if (record_.sample_rate != rate_)
+        {
+            capture_converter_.reset(new PcmConverter(
+                (int)record_.sample_format, rate_, record_.channels,
+                (int)record_.sample_format, record_.sample_rate, record_.channels));
+            capture_buf_.resize(capture_converter_->MaxOutputBytes(4 * period * record_.BytesPerFrame()));
+        }
+        if (play_.sample_rate != rate_)
+        {
+            play_converter_.reset(new PcmConverter(
+                (int)play_.sample_format, play_.sample_rate, play_.channels,
+                (int)play_.sample_format, rate_, play_.channels));
+            play_buf_.resize(4 * period * play_.BytesPerFrame());
+            play_fifo_.resize(4 * period * play_.BytesPerFrame() + play_converter_->MaxOutputBytes(play_buf_.size()));
+            play_fifo_bytes_ = 0;
+        }
+        play_.AddCb(PlayDev::PlayCb, &play_, "mixer");
+
+        if (ma_device_start(&device) != MA_SUCCESS)
+        {
+            printf("Failed to start duplex device\n");
+            play_.RemoveCb(PlayDev::PlayCb);
+            ma_device_uninit(&device);
+            ma_context_uninit(&context);
+            return -1;
+        }
+        opened_ = true;
+        play_.latency_ms = SoundDev::LatencyMs(device.playback.internalPeriodSizeInFrames, device.playback.internalPeriods, device.playback.internalSampleRate);
+        record_.latency_ms = SoundDev::LatencyMs(device.capture.internalPeriodSizeInFrames, device.capture.internalPeriods, device.capture.internalSampleRate);
+        play_.report = SoundDev::Describe(ma_get_backend_name(device.pContext->backend), device.thread, device.playback.internalPeriodSizeInFrames, device.playback.internalPeriods,
+                                          device.playback.internalSampleRate, device.alsa.isUsingMMapPlayback);
+        record_.report = SoundDev::Describe(ma_get_backend_name(device.pContext->backend), device.thread, device.capture.internalPeriodSizeInFrames, device.capture.internalPeriods,
+                                            device.capture.internalSampleRate, device.alsa.isUsingMMapCapture);
+        open_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return 0;
+    }
+
+    // Only tears down what a successful Open() set up
+    int Close()
+    {
+        if (!opened_)
+        {
+            return 0;
+        }
+        ma_device_uninit(&device);
+        play_.RemoveCb(PlayDev::PlayCb);
+        ma_context_uninit(&context);
+        opened_ = false;
+        return 0;
+    }
+};
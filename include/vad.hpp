@@ -0,0 +1,243 @@
+#pragma once
+#include <stdint.h>
+#include <math.h>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+#include "sound.hpp"
+
+struct VadConfig
+{
+    bool enabled = true;
+    int frame_ms = 20;          // analysis frame, 10-100 ms
+    int send_ms = 40;           // open-gate audio is sent in frames this long, a multiple of frame_ms
+    float snr_db = 9.0f;        // frame energy above the noise floor that counts as speech
+    float min_energy_db = -50;  // frames quieter than this (dBFS) are never speech
+    float zcr_max = 0.35f;      // zero crossings per sample above this are noise, not speech
+    float tilt_max = 1.2f;      // high/low band energy ratio above this is hiss, white noise is ~2
+    int onset_ms = 60;          // speech needed to open the gate
+    int hangover_ms = 800;      // gate stays open this long after the last speech frame
+    int preroll_ms = 300;       // audio before the onset that is sent with it
+};
+
+// Energy plus spectral-shape voice activity detector for the uplink. Audio is analysed in
+// frames; only speech segments, padded by pre-roll and hangover, are passed to the sender.
+// Single-threaded: call Process() from the thread that sends.
+class Vad
+{
+private:
+    VadConfig config_;
+    ma_format format_;
+    int channels_;
+    int sample_rate_;
+    size_t frame_bytes_;
+    size_t send_bytes_;
+    std::vector<uint8_t> out_; // open-gate audio not yet sent
+    int onset_frames_;
+    int hangover_frames_;
+    std::vector<uint8_t> pending_; // partial analysis frame
+    std::unique_ptr<PcmRing> preroll_;
+    float noise_db_ = 0;
+    bool have_noise_ = false;
+    bool open_ = false;
+    int speech_run_ = 0; // consecutive speech frames
+    int silence_run_ = 0; // consecutive non-speech frames while open
+
+    // Energy (dBFS), zero-crossing rate and high/low band ratio of the first channel
+    void Features(const uint8_t *frame, float &energy_db, float &zcr, float &tilt) const
+    {
+        size_t samples = frame_bytes_ / ma_get_bytes_per_frame(format_, channels_);
+        double energy = 0, diff = 0;
+        int crossings = 0;
+        float prev = 0;
+        for (size_t i = 0; i < samples; i++)
+        {
+            float x = format_ == ma_format_f32 ? ((const float *)frame)[i * channels_]
+                                               : ((const int16_t *)frame)[i * channels_] * (1.0f / 32768.0f);
+            energy += x * x;
+            if (i > 0)
+            {
+                diff += (x - prev) * (x - prev);
+                crossings += (x >= 0) != (prev >= 0);
+            }
+            prev = x;
+        }
+        energy_db = 10 * log10f((float)(energy / samples) + 1e-10f);
+        zcr = (float)crossings / samples;
+        tilt = (float)(diff / (energy + 1e-10));
+    }
+
+    bool IsSpeech(const uint8_t *frame)
+    {
+        float energy_db, zcr, tilt;
+        Features(frame, energy_db, zcr, tilt);
+        if (!have_noise_)
+        {
+            noise_db_ = energy_db;
+            have_noise_ = true;
+        }
+        bool speech = energy_db > config_.min_energy_db && energy_db > noise_db_ + config_.snr_db &&
+                      zcr < config_.zcr_max && tilt < config_.tilt_max;
+        // Noise floor: drops fast, rises slowly, and barely moves during speech
+        float rate = energy_db < noise_db_ ? 0.3f : (speech ? 0.001f : 0.02f);
+        noise_db_ += (energy_db - noise_db_) * rate;
+        return speech;
+    }
+
+    template <class Send>
+    void DrainPreroll(Send &send)
+    {
+        const uint8_t *region;
+        size_t n;
+        while ((n = preroll_->read_region(&region)) > 0)
+        {
+            send(region, n);
+            sent_s += (double)n / bytes_per_s();
+            gated_s -= (double)n / bytes_per_s();
+            preroll_->commit_read(n);
+        }
+    }
+
+    // Batches open-gate analysis frames into send_ms frames; flush sends what is left
+    template <class Send>
+    void Emit(Send &send, const uint8_t *frame, bool flush)
+    {
+        if (frame)
+        {
+            out_.insert(out_.end(), frame, frame + frame_bytes_);
+            sent_s += frame_bytes_ / bytes_per_s();
+        }
+        if (!out_.empty() && (flush || out_.size() >= send_bytes_))
+        {
+            send(out_.data(), out_.size());
+            out_.clear();
+        }
+    }
+
+    double bytes_per_s() const
+    {
+        return (double)sample_rate_ * ma_get_bytes_per_frame(format_, channels_);
+    }
+
+public:
+    double sent_s = 0;      // audio passed to the sender
+    double gated_s = 0;     // audio held back as non-speech
+    uint64_t segments = 0;  // times the gate opened
+
+    Vad(int sample_rate, int format, int channels)
+        : format_((ma_format)format), channels_(channels), sample_rate_(sample_rate)
+    {
+        Configure(config_);
+    }
+
+    void Configure(const VadConfig &config)
+    {
+        config_ = config;
+        config_.frame_ms = std::min(std::max(config.frame_ms, 10), 100);
+        config_.send_ms = std::max(config.send_ms / config_.frame_ms, 1) * config_.frame_ms;
+        size_t bytes_per_frame = ma_get_bytes_per_frame(format_, channels_);
+        frame_bytes_ = std::max<size_t>(1, sample_rate_ * config_.frame_ms / 1000) * bytes_per_frame;
+        send_bytes_ = config_.send_ms / config_.frame_ms * frame_bytes_;
+        onset_frames_ = std::max(1, config_.onset_ms / config_.frame_ms);
+        hangover_frames_ = config_.hangover_ms / config_.frame_ms;
+        int preroll_frames = std::max(config_.preroll_ms / config_.frame_ms, onset_frames_);
+        preroll_.reset(new PcmRing(preroll_frames * frame_bytes_, frame_bytes_));
+        pending_.clear();
+        pending_.reserve(frame_bytes_);
+        out_.clear();
+        out_.reserve(send_bytes_);
+        open_ = false;
+        speech_run_ = 0;
+        silence_run_ = 0;
+    }
+
+    const VadConfig &config() const
+    {
+        return config_;
+    }
+
+    bool speaking() const
+    {
+        return open_;
+    }
+
+    // Opens the gate as if speech had just started, e.g. on a wake word. The pre-roll and any
+    // unsent audio are dropped: the caller sends its own audio from before this point.
+    void Open()
+    {
+        if (!open_)
+            segments++;
+        open_ = true;
+        silence_run_ = 0;
+        preroll_->commit_read(preroll_->size());
+        out_.clear();
+    }
+
+    // Feeds captured audio and calls send(const uint8_t *data, size_t size) for whatever
+    // should go to the uplink. When disabled everything is passed through.
+    template <class Send>
+    void Process(const uint8_t *data, size_t size, Send send)
+    {
+        if (!config_.enabled)
+        {
+            send(data, size);
+            sent_s += size / bytes_per_s();
+            return;
+        }
+        while (size > 0)
+        {
+            const uint8_t *frame = data;
+            if (!pending_.empty() || size < frame_bytes_)
+            {
+                size_t n = std::min(size, frame_bytes_ - pending_.size());
+                pending_.insert(pending_.end(), data, data + n);
+                data += n;
+                size -= n;
+                if (pending_.size() < frame_bytes_)
+                    break;
+                frame = pending_.data();
+            }
+            else
+            {
+                data += frame_bytes_;
+                size -= frame_bytes_;
+            }
+
+            bool speech = IsSpeech(frame);
+            speech_run_ = speech ? speech_run_ + 1 : 0;
+            if (open_)
+            {
+                silence_run_ = speech ? 0 : silence_run_ + 1;
+                if (silence_run_ > hangover_frames_)
+                {
+                    open_ = false;
+                    Emit(send, nullptr, true);
+                }
+            }
+            else if (speech_run_ >= onset_frames_)
+            {
+                open_ = true;
+                silence_run_ = 0;
+                segments++;
+                DrainPreroll(send);
+            }
+
+            if (open_)
+            {
+                Emit(send, frame, false);
+            }
+            else
+            {
+                // Keep the most recent pre-roll, dropping the oldest frame when full
+                if (preroll_->size() + frame_bytes_ > preroll_->capacity())
+                {
+                    preroll_->commit_read(frame_bytes_);
+                }
+                preroll_->write(frame, frame_bytes_);
+                gated_s += frame_bytes_ / bytes_per_s();
+            }
+            pending_.clear();
+        }
+    }
+};
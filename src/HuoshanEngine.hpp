@@ -5,11 +5,18 @@
 #include <chrono> 
 #include <regex> 
 #include <fstream>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #define SIMPLEWEB_USE_STANDALONE_ASIO 1
 #define ASIO_USE_TS_EXECUTOR_AS_DEFAULT  1
 #include "simpleweb/wss_client.hpp"
 #include "json.hpp"
 #include "sound.hpp"
+#include "beamformer.hpp"
+#include "aec.hpp"
+#include "vad.hpp"
+#include "kws.hpp"
 #include "log_.h"
 
 #include <mars_message/String.hpp>
@@ -60,6 +67,7 @@ enum Event
     TaskRequest = 200,
     SayHello = 300,
     ChatTTSText = 500,
+    ClientInterrupt = 515,
     ConnectionStarted = 50,
     ConnectionFailed = 51,
     ConnectionFinished = 52,
@@ -77,31 +85,125 @@ enum Event
     ChatEnded = 559,
 };
 
+// Builds a complete request frame (header, event, session id, payload) into one buffer.
+// The buffer is resized in place, so a reused std::string keeps its capacity and
+// steady-state framing does no heap allocation.
+struct HuoshanFrame
+{
+    static size_t Size(const std::string *session_id, size_t payload_len)
+    {
+        return 4 + 4 + (session_id ? 4 + session_id->size() : 0) + 4 + payload_len;
+    }
+    static uint8_t *PutU32(uint8_t *p, uint32_t d)
+    {
+        p[0] = (d >> 24) & 0xFF;
+        p[1] = (d >> 16) & 0xFF;
+        p[2] = (d >> 8) & 0xFF;
+        p[3] = d & 0xFF;
+        return p + 4;
+    }
+    // Returns true if the buffer had to grow (i.e. a heap allocation happened)
+    static bool Write(std::string &out, uint8_t message_type, uint8_t serialization, uint32_t event,
+                      const std::string *session_id, const void *payload, size_t payload_len,
+                      uint8_t version = 0x1, uint8_t message_flags = MSG_WITH_EVENT, uint8_t compression = NO_COMPRESSION)
+    {
+        size_t size = Size(session_id, payload_len);
+        bool grown = size > out.capacity();
+        out.resize(size);
+        uint8_t *p = (uint8_t *)&out[0];
+        *p++ = (version << 4) | 0x1; // header_size = 1 (4 bytes)
+        *p++ = (message_type << 4) | (message_flags & 0x0F);
+        *p++ = (serialization << 4) | (compression & 0x0F);
+        *p++ = 0;
+        p = PutU32(p, event);
+        if(session_id)
+        {
+            p = PutU32(p, session_id->size());
+            memcpy(p, session_id->data(), session_id->size());
+            p += session_id->size();
+        }
+        p = PutU32(p, payload_len);
+        if(payload_len)
+        {
+            memcpy(p, payload, payload_len);
+        }
+        return grown;
+    }
+    static std::string Make(uint32_t event, const std::string *session_id, const std::string &json)
+    {
+        std::string d;
+        Write(d, FULL_CLIENT_REQ, JSON, event, session_id, json.data(), json.size());
+        return d;
+    }
+};
+
+// Decoded response frame. session_id and payload point into the received message
+// buffer and are only valid while that buffer is alive.
+struct HuoshanFrameView
+{
+    uint8_t version = 0;
+    uint8_t header_size = 0;
+    uint8_t message_type = 0;
+    uint8_t message_flags = 0;
+    uint8_t serialization = 0;
+    uint8_t compression = 0;
+    uint32_t code = 0;
+    uint32_t seq = 0;
+    uint32_t event = 0;
+    const char *session_id = nullptr;
+    uint32_t session_id_size = 0;
+    const char *payload = nullptr;
+    uint32_t payload_size = 0;
+
+    std::string Payload() const
+    {
+        return std::string(payload, payload_size);
+    }
+};
+
+// Bounds-checked reader over a received frame
+class HuoshanFrameReader
+{
+    const uint8_t *p;
+    size_t left;
+public:
+    HuoshanFrameReader(const void *data, size_t size) : p((const uint8_t *)data), left(size) {}
+    bool U32(uint32_t &d)
+    {
+        if(left < 4)
+        {
+            return false;
+        }
+        d = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+        p += 4;
+        left -= 4;
+        return true;
+    }
+    bool Bytes(uint32_t size, const char *&d)
+    {
+        if(left < size)
+        {
+            return false;
+        }
+        d = (const char *)p;
+        p += size;
+        left -= size;
+        return true;
+    }
+    bool Skip(size_t size)
+    {
+        if(left < size)
+        {
+            return false;
+        }
+        p += size;
+        left -= size;
+        return true;
+    }
+};
+
 struct HuoshanProto
 {
-    struct Header
-    {
-        uint8_t header_size:4;
-        uint8_t version:4;
-        uint8_t message_flags:4;
-        uint8_t message_type:4;
-        uint8_t compression:4;
-        uint8_t serialization:4;
-        uint8_t reserved;
-    }header;
-    struct Optional
-    {
-        uint32_t code;
-        uint32_t seq;
-        uint32_t event;
-        uint32_t conn_id_size;
-        std::string conn_id;
-        uint32_t sess_id_size;
-        std::string sess_id;
-    }optional;
-    uint32_t payload_size;
-    std::string payload;
-    uint32_t session_id_size;
     std::string session_id;
     bool is_ready = false;
     int play_idle = 0;
@@ -109,6 +211,9 @@ struct HuoshanProto
     std::string prompt;
     std::string hello;
     std::string asrText;
+    // Reusable uplink audio frame, sized on the first TaskRequest
+    std::string audio_frame;
+    size_t audio_frame_grows = 0;
 
     HuoshanProto()
     {
@@ -121,97 +226,91 @@ struct HuoshanProto
         this->hello = hello;
     }
 
-    std::string genrate_header(uint8_t version = 0x1, 
-                                        uint8_t message_type = FULL_CLIENT_REQ,
-                                        uint8_t message_flags = MSG_WITH_EVENT,
-                                        uint8_t serialization = JSON,
-                                        uint8_t compression = NO_COMPRESSION)
-    {
-        Header header;
-        header.version = version;
-        header.header_size = 1;
-        header.message_type = message_type;
-        header.message_flags = message_flags;
-        header.serialization = serialization;
-        header.compression = compression;
-        std::string buffer;
-        uint8_t *d = (uint8_t *)&header;
-        for(size_t i=0; i<sizeof(Header); i++)
-        {
-            buffer.push_back(d[i]);
-        }
-        return buffer;
-    }
-
-    std::string to_bytesb(uint32_t d)
+    // Decodes a response in place; returns false if any length field runs past the end
+    static bool Decode(const char *data, size_t size, HuoshanFrameView &h)
     {
-        // d = htonl(d); // Convert to network byte order (big-endian)
-        // Create a vector to hold the bytes in big-endian order
-        std::string  buffer(sizeof(d), '\0');
-        // Convert d to big-endian representation
-        buffer[0] = (d >> 24) & 0xFF;
-        buffer[1] = (d >> 16) & 0xFF;
-        buffer[2] = (d >> 8) & 0xFF;
-        buffer[3] = d & 0xFF;
-        return buffer;
-    }
-    int from_byteb(char* bytes)
-    {
-        int r = (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
-        return r;
+        if(data == nullptr || size < 4)
+        {
+            return false;
+        }
+        const uint8_t *d = (const uint8_t *)data;
+        h.version = d[0] >> 4;
+        h.header_size = d[0] & 0x0F;
+        h.message_type = d[1] >> 4;
+        h.message_flags = d[1] & 0x0F;
+        h.serialization = d[2] >> 4;
+        h.compression = d[2] & 0x0F;
+        HuoshanFrameReader r(data, size);
+        if(h.header_size == 0 || !r.Skip(h.header_size * 4))
+        {
+            return false;
+        }
+        if(h.message_type == FULL_SERVER_RSP || h.message_type == AUDIO_ONLY_RSP)
+        {
+            if(h.message_flags & POS_SEQUENCE)
+            {
+                if(!r.U32(h.seq))
+                {
+                    return false;
+                }
+            }
+            if(h.message_flags & MSG_WITH_EVENT)
+            {
+                if(!r.U32(h.event))
+                {
+                    return false;
+                }
+            }
+            if(!r.U32(h.session_id_size) || !r.Bytes(h.session_id_size, h.session_id))
+            {
+                return false;
+            }
+        }
+        else if(h.message_type == ERROR_INFO)
+        {
+            if(!r.U32(h.code))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            return true;
+        }
+        return r.U32(h.payload_size) && r.Bytes(h.payload_size, h.payload);
     }
 
-    HuoshanProto parse(std::string response)
-    {
-        HuoshanProto hp;
-        hp.header.version = response[0] >> 4;
-        hp.header.header_size = response[0] & 0x0F;
-        hp.header.message_type = response[1] >> 4;
-        hp.header.message_flags = response[1] & 0x0F;
-        hp.header.serialization = response[2] >> 4;
-        hp.header.compression = response[2] & 0x0F;
-        LOGD(TAG, "HS: len:{}, message_type: {}, serialization: {}, compression: {}", response.length(), (int)hp.header.message_type, (int)hp.header.serialization, (int)hp.header.compression);
-        hp.header.reserved = response[3];
-        auto op = &response[4];
-        int start = 0;
-        if(hp.header.message_type == FULL_SERVER_RSP || hp.header.message_type == AUDIO_ONLY_RSP)
-        {
-            if(hp.header.message_flags & NEG_SEQUENCE)
-            {
-                hp.optional.seq = from_byteb(&op[start]);
-                start += 4;
-            }
-            if(hp.header.message_flags & MSG_WITH_EVENT)
-            {
-                hp.optional.event = from_byteb(&op[start]);
-                if(hp.optional.event == Event::SessionStarted)
+    bool parse(const char *data, size_t size, HuoshanFrameView &h)
+    {
+        if(!Decode(data, size, h))
+        {
+            LOGE(TAG, "HS: malformed frame, len:{}", size);
+            return false;
+        }
+        LOGD(TAG, "HS: len:{}, message_type: {}, serialization: {}, compression: {}", size, (int)h.message_type, (int)h.serialization, (int)h.compression);
+        if(h.message_type == FULL_SERVER_RSP || h.message_type == AUDIO_ONLY_RSP)
+        {
+            if(h.message_flags & MSG_WITH_EVENT)
+            {
+                if(h.event == Event::SessionStarted)
                 {
                     is_ready = true;
                 }
-                else if(hp.optional.event == Event::SessionFinished)
+                else if(h.event == Event::SessionFinished)
                 {
                     is_ready = false;
                 }
-                LOGD(TAG, "HS: event: {}", hp.optional.event);
-                start += 4;
+                LOGD(TAG, "HS: event: {}", h.event);
             }
-            hp.session_id_size = from_byteb(&op[start]);
-            start += sizeof(hp.session_id_size);
-            hp.session_id.insert(hp.session_id.end(), &op[start], &op[start] + hp.session_id_size);
-            start += hp.session_id_size;
-            hp.payload_size = from_byteb(&op[start]);
-            start += sizeof(hp.payload_size);
-            hp.payload.insert(hp.payload.end(), &op[start], &op[start] + hp.payload_size);
-            if(hp.header.serialization == JSON)
+            if(h.serialization == JSON)
             {
-                hp.payload += "\0";
-                LOGD(TAG, "HS: payload: {}", hp.payload.c_str());
+                LOGD(TAG, "HS: payload: {}", spdlog::string_view_t(h.payload, h.payload_size));
             }
-            if(hp.optional.event == TTSSentenceStart)
+            if(h.event == TTSSentenceStart)
             {
                 if(disabled_remote)
                 {
-                    nlohmann::json json = nlohmann::json::parse(hp.payload);
+                    nlohmann::json json = nlohmann::json::parse(h.payload, h.payload + h.payload_size);
                     if(json["tts_type"] == "chat_tts_text")
                     {
                         disabled_remote = false;
@@ -219,150 +318,76 @@ struct HuoshanProto
                     }
                 }
             }
-            
         }
-        else if(hp.header.message_type == ERROR_INFO)
+        else if(h.message_type == ERROR_INFO)
         {
-            hp.optional.code = from_byteb(&op[start]);
-            LOGD(TAG, "HS: error: {}", hp.optional.code);
-            start += 4;
-            hp.payload_size = from_byteb(&op[start]);
-            start += sizeof(hp.payload_size);
-            LOGD(TAG, "HS: payload_size: {}", hp.payload_size);
-            hp.payload.insert(hp.payload.end(), &op[start], &op[start] + hp.payload_size);
-            if(hp.header.serialization == JSON)
+            LOGD(TAG, "HS: error: {}", h.code);
+            LOGD(TAG, "HS: payload_size: {}", h.payload_size);
+            if(h.serialization == JSON)
             {
-                hp.payload += "\0";
-                LOGD(TAG, "HS: payload: {}", hp.payload.c_str());
+                LOGD(TAG, "HS: payload: {}", spdlog::string_view_t(h.payload, h.payload_size));
             }
         }
-        return hp;
+        return true;
     }
 
     std::string StartConnect()
     {
-        auto d = genrate_header();
-        d.append(to_bytesb(Event::StartConnect));
-        std::string json = "{}";
-        d.append(to_bytesb(json.length())); // payload size
-        d.append(json); // payload
-        
+        auto d = HuoshanFrame::Make(Event::StartConnect, nullptr, "{}");
         LOGD(TAG, "HS: StartConnect ----{}", spdlog::to_hex(d));
         return d;
     }
     std::string FinishConnect()
     {
         LOGD(TAG, "HS: FinishConnect");
-        auto d = genrate_header();
-        d.append(to_bytesb(Event::FinishConnection));
-        std::string json = "{}";
-        d.append(to_bytesb(json.size())); // payload size
-        d.append(json); // payload
-        return d;
+        return HuoshanFrame::Make(Event::FinishConnection, nullptr, "{}");
     }
     
     std::string StartSession()
     {
         LOGD(TAG, "HS: StartSession");
-        auto d = genrate_header();
-        d += to_bytesb(Event::StartSession);
-       
-        d += to_bytesb(session_id.length());
-        d += session_id;
-        
-        d += to_bytesb(prompt.length());
-        d += prompt;
-        return d;
+        return HuoshanFrame::Make(Event::StartSession, &session_id, prompt);
     }
-    std::string TaskRequest(const void* audio, size_t len)
+    // The returned frame lives in audio_frame and is overwritten by the next call
+    const std::string &TaskRequest(const void* audio, size_t len)
     {
-        //printf("HS: TaskRequest\n");
-        auto d = genrate_header(0x1, AUDIO_ONLY_REQ, MSG_WITH_EVENT, NO_SERIALIZATION);
-        d += to_bytesb(Event::TaskRequest);
-        
-        d += to_bytesb(session_id.length());
-        d += session_id;
-
-        auto payload_size = to_bytesb(len);
-        d += to_bytesb(len); // payload size
-        d.insert(d.end(), (const uint8_t*)audio, (const uint8_t*)audio + len); // payload
-        return d;
+        if(HuoshanFrame::Write(audio_frame, AUDIO_ONLY_REQ, NO_SERIALIZATION, Event::TaskRequest, &session_id, audio, len))
+        {
+            audio_frame_grows++;
+        }
+        return audio_frame;
     }
     std::string FinishSession()
     {
         LOGD(TAG, "HS: FinishSession");
-        auto d = genrate_header();
-        auto opt = to_bytesb(Event::FinishSession);
-        d.insert(d.end(), opt.begin(), opt.end());
-
-        auto sid_size = to_bytesb(session_id.length());
-        d.insert(d.end(), sid_size.begin(), sid_size.end());
-        d.insert(d.end(), session_id.begin(), session_id.end());
-
-        std::string json = "{}";
-        auto size_bytes = to_bytesb(json.size());
-        d.insert(d.end(), size_bytes.begin(), size_bytes.end()); // payload size
-        d.insert(d.end(), json.begin(), json.end()); // payload
-        return d;
+        return HuoshanFrame::Make(Event::FinishSession, &session_id, "{}");
     }
     std::string SayHello()
     {
-        LOGD(TAG, "HS: SayHello");
-        auto d = genrate_header();
-        auto opt = to_bytesb(Event::SayHello);
-        d.insert(d.end(), opt.begin(), opt.end());
-
-        auto sid_size = to_bytesb(session_id.length());
-        d.insert(d.end(), sid_size.begin(), sid_size.end());
-        d.insert(d.end(), session_id.begin(), session_id.end());
-
-        nlohmann::json json;
-        json["content"] = hello;
-        std::string json_str = json.dump();
-        auto size_bytes = to_bytesb(json_str.size());
-        d.insert(d.end(), size_bytes.begin(), size_bytes.end()); // payload size
-        d.insert(d.end(), json_str.begin(), json_str.end()); // payload
-        return d;
+        return SayHello(hello);
     }
     std::string SayHello(const std::string &content)
     {
         LOGD(TAG, "HS: SayHello");
-        auto d = genrate_header();
-        auto opt = to_bytesb(Event::SayHello);
-        d.insert(d.end(), opt.begin(), opt.end());
-
-        auto sid_size = to_bytesb(session_id.length());
-        d.insert(d.end(), sid_size.begin(), sid_size.end());
-        d.insert(d.end(), session_id.begin(), session_id.end());
-
         nlohmann::json json;
         json["content"] = content;
-        std::string json_str = json.dump();
-        auto size_bytes = to_bytesb(json_str.size());
-        d.insert(d.end(), size_bytes.begin(), size_bytes.end()); // payload size
-        d.insert(d.end(), json_str.begin(), json_str.end()); // payload
-        return d;
+        return HuoshanFrame::Make(Event::SayHello, &session_id, json.dump());
+    }
+    // Asks the service to stop the reply being generated. Not every service version knows it,
+    // see "barge_in" in localai.json.
+    std::string ClientInterrupt()
+    {
+        LOGD(TAG, "HS: ClientInterrupt");
+        return HuoshanFrame::Make(Event::ClientInterrupt, &session_id, "{}");
     }
     std::string ChatTTSText(const std::string &text, bool start, bool end)
     {
         LOGD(TAG, "HS: ChatTTSText: {}", text.c_str());
-        auto d = genrate_header();
-        auto opt = to_bytesb(Event::ChatTTSText);
-        d.insert(d.end(), opt.begin(), opt.end());
-
-        auto sid_size = to_bytesb(session_id.length());
-        d.insert(d.end(), sid_size.begin(), sid_size.end());
-        d.insert(d.end(), session_id.begin(), session_id.end());
-
         nlohmann::json json;
         json["start"] = start;
         json["content"] = text;
         json["end"] = end;
-        std::string json_str = json.dump();
-        auto size_bytes = to_bytesb(json_str.size());
-        d.insert(d.end(), size_bytes.begin(), size_bytes.end()); // payload size
-        d.insert(d.end(), json_str.begin(), json_str.end()); // payload
-        return d;
+        return HuoshanFrame::Make(Event::ChatTTSText, &session_id, json.dump());
     }
 };
 
@@ -487,7 +512,302 @@ class HuoshanEngine
     RecordDev *recordDev;
     LocalAi *local_ai;
     PcmConverter pcm_converter;
-    AudioQueue apool;
+    std::vector<uint8_t> tts_pcm; // converted TTS packet, reused
+    MixerSource *tts; // TTS input of playDev's mixer
+    JitterBuffer jitter;
+    // Reconnect latency breakdown
+    std::chrono::steady_clock::time_point connect_start;
+    std::chrono::steady_clock::time_point start_connect_sent;
+    std::chrono::steady_clock::time_point start_session_sent;
+    // LCM fd watched by the client's io_context, see Run()
+    std::unique_ptr<asio::posix::stream_descriptor> lcm_fd;
+    std::unique_ptr<asio::steady_timer> stats_timer;
+    // Capture audio handed from the record callback to the network thread
+    PcmRing mic_ring;
+    std::vector<uint8_t> mic_chunk;
+    Beamformer beam; // mixes the mic array down to the one channel everything after it works on
+    std::vector<uint8_t> beam_chunk;
+    EchoCanceller aec; // removes our own playback from the capture, before anything else sees it
+    Vad vad; // uplink speech gate
+    // While the uplink is closed (no session yet, or asleep) only the latest audio is kept, and
+    // sent ahead of the live audio when it opens
+    std::unique_ptr<PrerollBuffer> preroll;
+    bool preroll_flush = true;    // send it when the session becomes ready, not only on a wake word
+    int preroll_chunk_ms = 200;   // per TaskRequest, so a flush fits the audio lane of the client
+    std::vector<uint8_t> preroll_out; // what the VAD passes of a flush
+    double turn_preroll_ms = 0;   // sent ahead of live audio since the last ASREnded
+    // Wake word: while asleep nothing is sent
+    KeywordSpotter kws;
+    bool awake = false;
+    int wake_timeout_ms = 8000; // back to sleep if the turn has not ended by then
+    std::chrono::steady_clock::time_point awake_until;
+    // Barge-in: speech over a reply cuts it off, and the rest of that reply is dropped
+    bool barge_in_local = true;     // on local speech, not only on the server's ASRInfo
+    int barge_in_onset_ms = 40;     // near-end speech over the playback needed to interrupt
+    bool barge_in_signal = false;   // also send ClientInterrupt
+    bool tts_active = false;        // from the first TTS sentence to TTSEnded
+    bool interrupted = false;
+    bool interrupt_pending = false; // waiting for the mixer to go silent
+    std::chrono::steady_clock::time_point interrupt_at;
+    uint64_t barge_ins = 0;
+    int mic_event;
+    std::unique_ptr<asio::posix::stream_descriptor> mic_fd;
+    uint64_t lcm_dispatches = 0;
+    long long cpu_us_last = 0;
+
+    static long long MsBetween(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to)
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(to - from).count();
+    }
+    static long long CpuUs()
+    {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+    }
+    void WaitLcm()
+    {
+        lcm_fd->async_wait(asio::posix::stream_descriptor::wait_read, [this](const asio::error_code &ec)
+        {
+            if(ec)
+            {
+                if(ec != asio::error::operation_aborted)
+                    LOGE(TAG, "LCM: wait failed {}", ec.message());
+                return;
+            }
+            // Drain whatever is queued without blocking the reactor
+            while(lcm->handleTimeout(0) > 0)
+                lcm_dispatches++;
+            WaitLcm();
+        });
+    }
+    // Frames and sends whatever the record callback queued, on the client's io_context
+    void WaitMic()
+    {
+        mic_fd->async_wait(asio::posix::stream_descriptor::wait_read, [this](const asio::error_code &ec)
+        {
+            if(ec)
+            {
+                if(ec != asio::error::operation_aborted)
+                    LOGE(TAG, "MIC: wait failed {}", ec.message());
+                return;
+            }
+            uint64_t count;
+            if(read(mic_event, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                LOGE(TAG, "MIC: read eventfd failed {}", strerror(errno));
+            size_t n;
+            while((n = mic_ring.read(mic_chunk.data(), mic_chunk.size())) > 0)
+            {
+                // While we play, the loudest source is our own speaker
+                beam.Freeze(Playing() || aec.far_active());
+                uint8_t *audio = beam_chunk.data();
+                n = beam.Process(mic_chunk.data(), n, audio);
+                // Runs even when nothing is sent, to stay converged and drain the reference
+                aec.Process(audio, n);
+                if(!proto.is_ready)
+                {
+                    preroll->Keep(audio, n);
+                    continue;
+                }
+                if(kws.enabled() && !IsAwake())
+                {
+                    preroll->Keep(audio, n);
+                    if(kws.Process(audio, n))
+                    {
+                        Wake();
+                    }
+                    continue;
+                }
+                if(preroll->size() > 0)
+                {
+                    FlushPreroll();
+                }
+                uint64_t onsets = vad.segments;
+                vad.Process(audio, n, [this](const uint8_t *audio, size_t len)
+                {
+                    client.send_audio(proto.TaskRequest(audio, len));
+                });
+                if(CanBargeIn(vad.segments != onsets))
+                {
+                    Interrupt("speech onset");
+                }
+            }
+            if(interrupt_pending && !tts->flushing.load(std::memory_order_acquire))
+            {
+                interrupt_pending = false;
+                auto silent = std::chrono::steady_clock::time_point(std::chrono::nanoseconds(tts->flushed_ns.load()));
+                LOGD(TAG, "Barge-in: playback silent {:.1f} ms after detection, detection needs {} ms of speech",
+                    std::chrono::duration<double, std::milli>(silent - interrupt_at).count(), barge_in_onset_ms);
+            }
+            WaitMic();
+        });
+    }
+    // Starts streaming the uplink: the audio that held the wake word goes first, then the
+    // VAD gate is forced open so the request that follows is not clipped
+    void Wake()
+    {
+        LOGD(TAG, "KWS: wake word detected, score {:.2f}", kws.last_score);
+        awake = true;
+        awake_until = std::chrono::steady_clock::now() + std::chrono::milliseconds(wake_timeout_ms);
+        vad.Open();
+        SendPreroll(nullptr, "wake word");
+    }
+    // The session has just become ready: what was said while it started goes first. It passes
+    // the VAD like live audio would, so silence is not sent and an utterance already under way
+    // keeps the gate open into the live audio.
+    void FlushPreroll()
+    {
+        if(!preroll_flush)
+        {
+            preroll->Clear();
+            return;
+        }
+        preroll_out.clear();
+        preroll->Drain(preroll->size(), [this](const uint8_t *audio, size_t len)
+        {
+            vad.Process(audio, len, [this](const uint8_t *out, size_t out_len)
+            {
+                preroll_out.insert(preroll_out.end(), out, out + out_len);
+            });
+        });
+        SendPreroll(&preroll_out, "session ready");
+    }
+    // Sends the pre-roll, or the part of it in passed, in preroll_chunk_ms frames as fast as
+    // the connection takes them
+    void SendPreroll(const std::vector<uint8_t> *passed, const char *reason)
+    {
+        auto start = std::chrono::steady_clock::now();
+        double kept_ms = preroll->ms();
+        size_t chunk = (size_t)recordDev->sample_rate * preroll_chunk_ms / 1000 * recordDev->BytesPerSample();
+        size_t frames = 0;
+        auto send = [this, &frames](const uint8_t *audio, size_t len)
+        {
+            client.send_audio(proto.TaskRequest(audio, len));
+            frames++;
+        };
+        double sent_ms;
+        if(passed)
+        {
+            for(size_t off = 0; off < passed->size(); off += chunk)
+            {
+                send(passed->data() + off, std::min(chunk, passed->size() - off));
+            }
+            sent_ms = passed->size() * 1000.0 / (recordDev->sample_rate * recordDev->BytesPerSample());
+            kept_ms = std::max(kept_ms, sent_ms);
+        }
+        else
+        {
+            preroll->Drain(chunk, send);
+            sent_ms = kept_ms;
+        }
+        turn_preroll_ms += sent_ms;
+        LOGD(TAG, "Preroll: {}, sent {:.0f} of {:.0f} ms in {} frames, {:.1f} ms", reason, sent_ms, kept_ms, frames,
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    void Sleep(const char *reason)
+    {
+        if(awake)
+        {
+            LOGD(TAG, "KWS: back to sleep, {}", reason);
+        }
+        awake = false;
+    }
+    bool IsAwake()
+    {
+        if(awake && std::chrono::steady_clock::now() > awake_until)
+        {
+            if(vad.speaking())
+            {
+                awake_until = std::chrono::steady_clock::now() + std::chrono::milliseconds(wake_timeout_ms);
+            }
+            else
+            {
+                Sleep("timed out");
+            }
+        }
+        return awake;
+    }
+    bool Playing()
+    {
+        return tts_active || tts->ring.size() > 0;
+    }
+    // Local speech while we play only counts once the echo canceller can tell it from our own
+    // playback: sustained double talk, or a VAD onset in a gap of the playback
+    bool CanBargeIn(bool vad_onset)
+    {
+        if(!barge_in_local || interrupted || !Playing() || !aec.config().enabled || !aec.converged())
+        {
+            return false;
+        }
+        return aec.double_talk_ms() >= barge_in_onset_ms || (vad_onset && !aec.far_active());
+    }
+    // Stops the reply: playback fades out within one device buffer and its remaining audio
+    // is dropped until the next turn
+    void Interrupt(const char *by)
+    {
+        interrupted = true;
+        jitter.Drop();
+        tts->Flush();
+        interrupt_at = std::chrono::steady_clock::now();
+        interrupt_pending = true;
+        barge_ins++;
+        LOGD(TAG, "Barge-in: {}, {} so far", by, barge_ins);
+        if(barge_in_signal && proto.is_ready)
+        {
+            client.send(proto.ClientInterrupt());
+        }
+        if(awake)
+        {
+            awake_until = interrupt_at + std::chrono::milliseconds(wake_timeout_ms);
+        }
+    }
+    static void MicCb(void *pUserdata, 
+                    void *pOutput, 
+                    const void *pInput, 
+                    ma_uint32 frameCount)
+    {
+        // Real-time thread: copy into the ring and wake the network thread, nothing else
+        HuoshanEngine *engine = static_cast<HuoshanEngine *>(pUserdata);
+        engine->mic_ring.write(pInput, frameCount * engine->recordDev->BytesPerFrame());
+        uint64_t one = 1;
+        ssize_t ret = write(engine->mic_event, &one, sizeof(one)); // EAGAIN only if a wakeup is already pending
+        (void)ret;
+    }
+    void LogLoopStats()
+    {
+        stats_timer->expires_after(std::chrono::seconds(60));
+        stats_timer->async_wait([this](const asio::error_code &ec)
+        {
+            if(ec)
+                return;
+            auto cpu_us = CpuUs();
+            LOGD(TAG, "Loop: cpu {} ms/min, lcm dispatches {}", (cpu_us - cpu_us_last) / 1000, lcm_dispatches);
+            LOGD(TAG, "Audio callbacks: playback {}; capture {}", playDev->CbReport(), recordDev->CbReport());
+            LOGD(TAG, "VAD: sent {:.1f} s, gated {:.1f} s, {} segments", vad.sent_s, vad.gated_s, vad.segments);
+            if(kws.enabled())
+            {
+                LOGD(TAG, "KWS: {} detections, listened {:.1f} s, cpu {:.2f}% of one core",
+                    kws.detections, kws.audio_s, kws.audio_s > 0 ? kws.cpu_us / kws.audio_s / 1e4 : 0.0);
+                kws.ResetStats();
+            }
+            LOGD(TAG, "Preroll: {} flushes, {:.1f} s sent", preroll->drains, preroll->drained_ms / 1000);
+            if(beam.audio_s > 0)
+            {
+                LOGD(TAG, "Beam: {}, azimuth {:.0f} deg, {} switches, cpu {:.2f}% of one core (budget {:.1f}%), {} fallbacks",
+                    beam.ModeName(), beam.azimuth_deg(), beam.switches, beam.cpu_us / beam.audio_s / 1e4,
+                    beam.config().cpu_budget * 100, beam.fallbacks);
+                beam.ResetStats();
+            }
+            if(aec.config().enabled && aec.audio_s > 0)
+            {
+                LOGD(TAG, "AEC: ERLE {:.1f} dB, double talk {}/{} blocks, echo delay {:.0f} ms, {} resyncs, cpu {:.2f}% of one core",
+                    aec.Erle(), aec.double_talk_blocks, aec.far_blocks, aec.EchoDelayMs(), aec.resyncs, aec.cpu_us / aec.audio_s / 1e4);
+                aec.ResetStats();
+            }
+            cpu_us_last = cpu_us;
+            LogLoopStats();
+        });
+    }
 public:
     std::string GetSessionId()
     {
@@ -509,35 +829,30 @@ public:
                   playDev(pDev),
                   recordDev(rDev),
                   local_ai(local_ai),
-                    pcm_converter(ma_format_f32, 24000, 1, playDev->sample_format, playDev->sample_rate, playDev->channels)
+                    pcm_converter(ma_format_f32, 24000, 1, playDev->sample_format, playDev->sample_rate, playDev->channels),
+                    tts(pDev->AddSource("tts", pDev->sample_rate * 20 * pDev->BytesPerFrame())), // 20 s
+                    jitter(tts->ring, pDev->sample_rate),
+                    mic_ring(rDev->sample_rate * rDev->BytesPerFrame(), rDev->BytesPerFrame()),
+                    mic_chunk(rDev->frames_per_buffer * rDev->BytesPerFrame()),
+                    beam(rDev->sample_rate, rDev->sample_format, rDev->channels),
+                    beam_chunk(rDev->frames_per_buffer * rDev->BytesPerSample()),
+                    aec(pDev->AddReference(pDev->sample_rate * pDev->BytesPerFrame()), // 1 s
+                        pDev->sample_rate, pDev->sample_format, pDev->channels,
+                        rDev->sample_rate, rDev->sample_format, 1),
+                    vad(rDev->sample_rate, rDev->sample_format, 1),
+                    preroll(new PrerollBuffer(1500, rDev->sample_rate, rDev->BytesPerSample())),
+                    kws(rDev->sample_rate, rDev->sample_format, 1),
+                    mic_event(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
     {
         // Constructor implementation
-        playDev->AddCb([](void *pUserdata, 
-                    void *pOutput, 
-                    const void *pInput, 
-                    ma_uint32 frameCount){
-                    HuoshanEngine *engine = static_cast<HuoshanEngine *>(pUserdata);
-                    auto audio = engine->apool.pop_front(engine->playDev->BytesPerFrame() * frameCount);
-                    if(audio.empty())
-                    {
-                        return;
-                    }
-                    engine->proto.play_idle = 0;
-                    memcpy(pOutput, audio.data(), audio.size());
-                    return;
-
-        }, this);
-        recordDev->AddCb([](void *pUserdata, 
-                    void *pOutput, 
-                    const void *pInput, 
-                    ma_uint32 frameCount) {
-                    HuoshanEngine *engine = static_cast<HuoshanEngine *>(pUserdata);
-                    if(engine->proto.is_ready)
-                    {
-                        engine->client.send(engine->proto.TaskRequest(pInput, frameCount * engine->recordDev->BytesPerFrame()));
-                    }
-                    return;
-        }, this);
+        recordDev->AddCb(MicCb, this, "mic");
+        preroll_out.reserve(rDev->sample_rate * 5 / 2 * rDev->BytesPerSample()); // the pre-roll and the VAD's own
+    }
+    ~HuoshanEngine()
+    {
+        recordDev->RemoveCb(MicCb, this);
+        mic_fd.reset();
+        close(mic_event);
     }
     void Connect(bool blocking = true)
     {
@@ -550,17 +865,41 @@ public:
         client.on_message = [this](std::shared_ptr<WssClient::Connection> connection, std::shared_ptr<WssClient::InMessage> in_message)
         {
             // Handle incoming messages
-            HandleResponse(connection, in_message->string());
+            HandleResponse(connection, in_message->data(), in_message->size());
         };
+        client.auto_reconnect = true;
         client.on_open = [this](std::shared_ptr<WssClient::Connection> connection)
         {
             // Handle connection open event
+            auto &stats = client.reconnect_stats;
+            if(stats.reconnects > 0)
+            {
+                LOGD(TAG, "Client: reconnected after {} attempts in {} ms (reconnects: {}, attempts: {}, max: {} ms)",
+                    stats.last_attempts, stats.last_latency.count(), stats.reconnects, stats.attempts, stats.max_latency.count());
+            }
+            auto &t = connection->timing;
+            LOGD(TAG, "Client: connect took {} ms: dns {} ms{}, tcp {} ms, tls {} ms{}, upgrade {} ms",
+                MsBetween(t.start, t.upgraded), MsBetween(t.start, t.resolved), t.resolve_cached ? " (cached)" : "",
+                MsBetween(t.resolved, t.connected), MsBetween(t.connected, t.handshaken), t.session_resumed ? " (resumed)" : "",
+                MsBetween(t.handshaken, t.upgraded));
+            connect_start = t.start;
             connection->send(proto.StartConnect());
+            start_connect_sent = std::chrono::steady_clock::now();
         };
-        client.on_close = [this](std::shared_ptr<WssClient::Connection> /*connection*/, int status, const std::string & /*reason*/)
+        client.on_close = [this](std::shared_ptr<WssClient::Connection> connection, int status, const std::string & /*reason*/)
         {
             LOGD(TAG, "Client: Closed connection with status code {}", status);
+            LOGD(TAG, "Client: sent {} frames, {} bytes in {} writes", connection->write_frames.load(), connection->write_bytes.load(), connection->write_count.load());
+            LOGD(TAG, "Client: received {} frames in {} reads, {} message allocations", connection->read_frames.load(), connection->read_count.load(), connection->in_message_allocs.load());
+            LOGD(TAG, "Client: {} audio frames dropped, {} still queued", connection->audio_dropped.load(), connection->audio_queued.load());
+            LOGD(TAG, "Client: {} capture bytes dropped by the mic ring", mic_ring.overruns.load());
+            LOGD(TAG, "Client: playback ring max depth {} bytes, {} underruns, {} bytes dropped", tts->ring.max_depth.load(), tts->ring.underruns.load(), tts->ring.overruns.load());
+            LOGD(TAG, "HS: audio frame buffer grew {} times", proto.audio_frame_grows);
             proto.is_ready = false;
+            jitter.Flush();
+            tts_active = false;
+            interrupted = false;
+            Sleep("connection closed");
         };
         client.on_error = [this](std::shared_ptr<WssClient::Connection> /*connection*/, const SimpleWeb::error_code &ec)
         {
@@ -568,20 +907,172 @@ public:
             proto.is_ready = false;
             LOGD(TAG, "Client: error message {}", ec.message());
         };
+        client.start_nonblock();
+        // Drain the capture ring from now on, not from the first open: until the session is
+        // ready the audio goes to the pre-roll, and the ring never fills with stale capture
+        if(!mic_fd)
+        {
+            mic_fd.reset(new asio::posix::stream_descriptor(*client.io_service, dup(mic_event)));
+            WaitMic();
+        }
         if(blocking)
         {
-            client.start();
+            client.run();
         }
-        else
+    }
+    // Uplink VAD settings, the "vad" object of localai.json. Missing keys keep their defaults.
+    void ConfigVad(const nlohmann::json &j)
+    {
+        if(!j.is_object())
+        {
+            return;
+        }
+        VadConfig c = vad.config();
+        c.enabled = j.value("enabled", c.enabled);
+        c.frame_ms = j.value("frame_ms", c.frame_ms);
+        c.send_ms = j.value("send_ms", c.send_ms);
+        c.snr_db = j.value("snr_db", c.snr_db);
+        c.min_energy_db = j.value("min_energy_db", c.min_energy_db);
+        c.zcr_max = j.value("zcr_max", c.zcr_max);
+        c.tilt_max = j.value("tilt_max", c.tilt_max);
+        c.onset_ms = j.value("onset_ms", c.onset_ms);
+        c.hangover_ms = j.value("hangover_ms", c.hangover_ms);
+        c.preroll_ms = j.value("preroll_ms", c.preroll_ms);
+        vad.Configure(c);
+        c = vad.config(); // frame sizes as clamped
+        LOGD(TAG, "VAD: enabled {}, {} ms frames sent as {} ms, snr {} dB, onset {} ms, hangover {} ms, preroll {} ms",
+            c.enabled, c.frame_ms, c.send_ms, c.snr_db, c.onset_ms, c.hangover_ms, c.preroll_ms);
+    }
+    // Pre-roll settings, the "preroll" object of localai.json: how much audio is kept while the
+    // uplink is closed, and whether it is sent when the session becomes ready
+    void ConfigPreroll(const nlohmann::json &j)
+    {
+        if(!j.is_object())
+        {
+            return;
+        }
+        int ms = j.value("ms", 1500);
+        preroll_flush = j.value("enabled", preroll_flush);
+        preroll_chunk_ms = std::max(j.value("chunk_ms", preroll_chunk_ms), 20);
+        preroll.reset(new PrerollBuffer(ms, recordDev->sample_rate, recordDev->BytesPerSample()));
+        preroll_out.reserve((size_t)recordDev->sample_rate * (ms + 1000) / 1000 * recordDev->BytesPerSample());
+        LOGD(TAG, "Preroll: {} ms, flush on session ready {}, {} ms frames", ms, preroll_flush, preroll_chunk_ms);
+    }
+    // Mic array settings, the "beamformer" object of localai.json. "mics" lists [x, y] in metres
+    // per capture channel; without one per channel only "channel" is used.
+    void ConfigBeam(const nlohmann::json &j)
+    {
+        if(!j.is_object())
+        {
+            return;
+        }
+        BeamformerConfig c = beam.config();
+        c.enabled = j.value("enabled", c.enabled);
+        c.channel = j.value("channel", c.channel);
+        c.azimuth_deg = j.value("azimuth_deg", c.azimuth_deg);
+        c.track = j.value("track", c.track);
+        c.directions = j.value("directions", c.directions);
+        c.cpu_budget = j.value("cpu_budget", c.cpu_budget);
+        if(j.contains("mics") && j["mics"].is_array())
+        {
+            c.mics.clear();
+            for(auto &mic : j["mics"])
+            {
+                if(mic.is_array() && mic.size() >= 2)
+                {
+                    c.mics.push_back({mic[0].get<float>(), mic[1].get<float>()});
+                }
+            }
+        }
+        beam.Configure(c);
+        if(c.enabled && beam.mode() != Beamformer::DelayAndSum && recordDev->channels > 1)
+        {
+            LOGW(TAG, "Beam: {} mic positions for {} capture channels, using channel {}", c.mics.size(), recordDev->channels, beam.config().channel);
+        }
+        LOGD(TAG, "Beam: {}, {} channels, azimuth {} deg, cpu budget {:.1f}%", beam.ModeName(), recordDev->channels, c.azimuth_deg, c.cpu_budget * 100);
+    }
+    // Echo canceller settings, the "aec" object of localai.json. Missing keys keep their defaults.
+    void ConfigAec(const nlohmann::json &j)
+    {
+        if(!j.is_object())
+        {
+            return;
+        }
+        AecConfig c = aec.config();
+        c.enabled = j.value("enabled", c.enabled);
+        c.delay_ms = j.value("delay_ms", c.delay_ms);
+        c.tail_ms = j.value("tail_ms", c.tail_ms);
+        c.mu = j.value("mu", c.mu);
+        c.dtd_ratio = j.value("dtd_ratio", c.dtd_ratio);
+        aec.Configure(c);
+        LOGD(TAG, "AEC: enabled {}, delay {} ms, tail {} ms", c.enabled, c.delay_ms, c.tail_ms);
+    }
+    // Barge-in settings, the "barge_in" object of localai.json
+    void ConfigBargeIn(const nlohmann::json &j)
+    {
+        if(!j.is_object())
         {
-            client.start_nonblock();
+            return;
         }
+        barge_in_local = j.value("enabled", barge_in_local);
+        barge_in_onset_ms = j.value("onset_ms", barge_in_onset_ms);
+        barge_in_signal = j.value("send_interrupt", barge_in_signal);
+        LOGD(TAG, "Barge-in: local {}, onset {} ms, send interrupt {}", barge_in_local, barge_in_onset_ms, barge_in_signal);
+    }
+    // Wake word settings, the "wakeword" object of localai.json. The keyword is enrolled from
+    // "templates", 16-bit PCM WAV recordings of it; without any the uplink stays always on.
+    void ConfigKws(const nlohmann::json &j)
+    {
+        if(!j.is_object())
+        {
+            return;
+        }
+        KwsConfig c = kws.config();
+        c.enabled = j.value("enabled", c.enabled);
+        c.threshold = j.value("threshold", c.threshold);
+        c.refractory_ms = j.value("refractory_ms", c.refractory_ms);
+        kws.Configure(c);
+        wake_timeout_ms = j.value("timeout_ms", wake_timeout_ms);
+        if(!c.enabled)
+        {
+            return;
+        }
+        if(j.contains("templates") && j["templates"].is_array())
+        {
+            for(auto &path : j["templates"])
+            {
+                if(!path.is_string() || !kws.LoadTemplate(path.get<std::string>()))
+                {
+                    LOGE(TAG, "KWS: cannot load template {}", path.dump());
+                }
+            }
+        }
+        if(kws.templates() == 0)
+        {
+            LOGE(TAG, "KWS: no templates loaded, wake word disabled");
+            return;
+        }
+        LOGD(TAG, "KWS: {} templates, threshold {}, timeout {} ms", kws.templates(), c.threshold, wake_timeout_ms);
     }
     void Poll() 
     {
         // Poll the client for incoming messages
         client.poll();
     }
+    // Runs websocket and LCM dispatch from one blocking io_context::run(): the LCM fd is
+    // registered with asio, so either side is handled as soon as it is readable and the
+    // thread sleeps while idle instead of polling. Call after Connect(false).
+    void Run()
+    {
+        lcm_fd.reset(new asio::posix::stream_descriptor(*client.io_service, dup(lcm->getFileno())));
+        stats_timer.reset(new asio::steady_timer(*client.io_service));
+        cpu_us_last = CpuUs();
+        WaitLcm();
+        LogLoopStats();
+        client.run();
+        stats_timer.reset();
+        lcm_fd.reset();
+    }
     void TTS(const std::string & text)
     {
 
@@ -595,24 +1086,46 @@ public:
         return replys[idx];
     }
 
-    void HandleResponse(std::shared_ptr<WssClient::Connection> connection, const std::string & response)
+    void HandleResponse(std::shared_ptr<WssClient::Connection> connection, const char *response, size_t size)
     {
-        HuoshanProto h = proto.parse(response);
-        if(h.optional.event == Event::ConnectionStarted)
+        HuoshanFrameView h;
+        if(!proto.parse(response, size, h))
         {
+            return;
+        }
+        if(h.event == Event::ConnectionStarted)
+        {
+            LOGD(TAG, "HS: StartConnect took {} ms", MsBetween(start_connect_sent, std::chrono::steady_clock::now()));
             connection->send(proto.StartSession());
+            start_session_sent = std::chrono::steady_clock::now();
         }
-        if(h.optional.event == Event::SessionStarted)
+        if(h.event == Event::SessionStarted)
         {
+            auto now = std::chrono::steady_clock::now();
+            LOGD(TAG, "HS: StartSession took {} ms, {} ms since connect started", MsBetween(start_session_sent, now), MsBetween(connect_start, now));
             proto.is_ready = true;
+            client.reconnect_succeeded(); // the server took the session, not just the upgrade
             connection->send(proto.SayHello());
         }
-        if(h.optional.event == Event::ASRResponse)
+        if(h.event == Event::ASRResponse)
+        {
+            proto.asrText = h.Payload();
+            if(awake)
+            {
+                awake_until = std::chrono::steady_clock::now() + std::chrono::milliseconds(wake_timeout_ms);
+            }
+        }
+        if(h.event == Event::ASRInfo && Playing() && !interrupted)
         {
-            proto.asrText = h.payload;
+            // The server heard the user start talking over the reply
+            Interrupt("server ASRInfo");
         }
-        if(h.optional.event == Event::ASREnded)
+        if(h.event == Event::ASREnded)
         {
+            // The next reply answers this utterance
+            interrupted = false;
+            LOGD(TAG, "Preroll: {:.0f} ms sent ahead of live audio this turn", turn_preroll_ms);
+            turn_preroll_ms = 0;
             try
             {
                 nlohmann::json j = nlohmann::json::parse(proto.asrText);
@@ -650,25 +1163,52 @@ public:
                 LOGD(TAG, "ASR Raw Data: {}", proto.asrText);
             }
         }
-        if(h.optional.event == Event::TTSEnded)
+        if(h.event == Event::TTSSentenceStart)
+        {
+            tts_active = true;
+            jitter.Start();
+        }
+        if(h.event == Event::TTSSentenceEnd)
         {
+            jitter.Flush();
+        }
+        if(h.event == Event::TTSEnded)
+        {
+            jitter.Flush();
+            LOGD(TAG, "HS: TTS jitter {:.1f} ms, target {} ms, {} packets, {} late, {} underruns",
+                jitter.jitter_ms, jitter.TargetMs(), jitter.packets, jitter.late_packets, jitter.underruns);
+            tts_active = false;
+            if(interrupted)
+            {
+                // The user is talking over it, the turn goes on
+                interrupted = false;
+            }
+            else
+            {
+                Sleep("turn ended");
+            }
             if(proto.disabled_remote)
             {
                 LOGD(TAG, "HS: TTS ended, reset remote");
                 proto.disabled_remote = false;
             }
         }
-        if(h.header.message_type == AUDIO_ONLY_RSP)
+        if(h.message_type == AUDIO_ONLY_RSP)
         {
             // printf("HS: audio: %d\n", hp.payload_size);
             // Convert 24000Hz Float32 audio to 8000Hz by taking every third sample
 
-            if(!proto.disabled_remote)
+            if(!proto.disabled_remote && !interrupted)
             {
-                std::vector<uint8_t> audio = pcm_converter.Convert(h.payload.data(), h.payload.size());
-                if(!audio.empty())
+                size_t need = pcm_converter.MaxOutputBytes(h.payload_size);
+                if(tts_pcm.size() < need)
+                {
+                    tts_pcm.resize(need);
+                }
+                size_t n = pcm_converter.Convert(h.payload, h.payload_size, tts_pcm.data(), tts_pcm.size());
+                if(n > 0)
                 {
-                    apool.push(audio);
+                    jitter.Push(tts_pcm.data(), n);
                 }
             }
         }
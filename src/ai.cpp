@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <mutex>
+#include <condition_variable>
 #include <thread>
 #include <chrono> 
 #include <regex> 
@@ -743,6 +744,9 @@ int main(int argc, char *argv[])
 #else
 #include "HuoshanEngine.hpp"
 #include "aixd.h"
+#ifdef AIXD_ALSA_MMAP
+#include "alsa_mmap.hpp"
+#endif
 int main(int argc, char *argv[])
 {
     lcm::LCM lcm;
@@ -753,9 +757,106 @@ int main(int argc, char *argv[])
         return 1;
     }
     PlayDev playDev(8000, ma_format_f32, 320, 1);
-    playDev.Open();
-    RecordDev recordDev(8000, ma_format_s16, 320, 1);
-    recordDev.Open();
+    RecordDev recordDev(8000, ma_format_s16, 320, 4); // the mic array, mixed down by Beamformer
+    // "audio": {"duplex": true} in localai.json runs both on one full-duplex device,
+    // "backend": "alsa_mmap" on the ALSA DMA buffers directly (built with -DAIXD_ALSA_MMAP=ON).
+    // The shipped defaults keep separate miniaudio devices with their own periods and scheduling;
+    // the low-latency profile is opt-in,
+    // e.g. "duplex": true, "period_ms": 10, "periods": 3, "rt_priority": 80 (needs CAP_SYS_NICE).
+    nlohmann::json audio_config = AiConfigs("localai.json")["audio"];
+    bool duplex = audio_config.is_object() && audio_config.value("duplex", false);
+    bool alsa_mmap = audio_config.is_object() && audio_config.value("backend", "miniaudio") == "alsa_mmap";
+    if(audio_config.is_object())
+    {
+        AudioTuning tuning;
+        tuning.period_ms = audio_config.value("period_ms", tuning.period_ms);
+        tuning.periods = audio_config.value("periods", tuning.periods);
+        tuning.mmap = audio_config.value("mmap", tuning.mmap);
+        tuning.low_latency = audio_config.value("low_latency", tuning.low_latency);
+        tuning.rt_priority = audio_config.value("rt_priority", tuning.rt_priority);
+        tuning.cpu = audio_config.value("cpu", tuning.cpu);
+        playDev.tuning = tuning;
+        recordDev.tuning = tuning;
+    }
+    DuplexDev duplexDev(playDev, recordDev);
+#ifdef AIXD_ALSA_MMAP
+    AlsaMmapDev alsaDev(playDev, recordDev,
+        audio_config.is_object() ? audio_config.value("alsa_playback", "default") : "default",
+        audio_config.is_object() ? audio_config.value("alsa_capture", "default") : "default");
+    // The ALSA thread can give up mid-run (device gone, restarts failing); fall back to the
+    // separate miniaudio devices then. Registered callbacks stay with playDev/recordDev.
+    std::mutex audio_mutex;
+    std::condition_variable audio_cv;
+    bool audio_done = false;
+    alsaDev.on_failure = [&](int err)
+    {
+        LOGE(TAG, "Audio: ALSA mmap backend stopped ({}), falling back to miniaudio", snd_strerror(err));
+        std::lock_guard<std::mutex> lock(audio_mutex);
+        audio_cv.notify_one();
+    };
+    std::thread audio_watch;
+    if(alsa_mmap && alsaDev.Open() < 0)
+    {
+        LOGE(TAG, "Audio: ALSA mmap backend failed, falling back to miniaudio");
+        alsa_mmap = false;
+    }
+#else
+    if(alsa_mmap)
+    {
+        LOGE(TAG, "Audio: built without the ALSA mmap backend, using miniaudio");
+        alsa_mmap = false;
+    }
+#endif
+    if(!alsa_mmap && duplex && duplexDev.Open() < 0)
+    {
+        LOGE(TAG, "Audio: duplex device failed, falling back to separate devices");
+        duplex = false;
+    }
+#ifdef AIXD_ALSA_MMAP
+    if(alsa_mmap)
+    {
+        LOGD(TAG, "Audio: ALSA mmap devices, open {:.1f} ms, playback buffer {:.1f} ms, capture buffer {:.1f} ms",
+            alsaDev.open_ms, playDev.latency_ms, recordDev.latency_ms);
+        audio_watch = std::thread([&]()
+        {
+            std::unique_lock<std::mutex> lock(audio_mutex);
+            audio_cv.wait(lock, [&]() { return audio_done || alsaDev.failed(); });
+            if(audio_done)
+                return;
+            alsaDev.Close();
+            alsa_mmap = false;
+            duplex = false;
+            if(playDev.Open() < 0 || recordDev.Open() < 0)
+            {
+                LOGE(TAG, "Audio: miniaudio fallback failed to open");
+                return;
+            }
+            LOGD(TAG, "Audio: fallback playback {}", playDev.report);
+            LOGD(TAG, "Audio: fallback capture {}", recordDev.report);
+        });
+    }
+    else
+#endif
+    if(duplex)
+    {
+        LOGD(TAG, "Audio: duplex device, open {:.1f} ms, playback buffer {:.1f} ms, capture buffer {:.1f} ms",
+            duplexDev.open_ms, playDev.latency_ms, recordDev.latency_ms);
+    }
+    else
+    {
+        if(playDev.Open() < 0)
+        {
+            LOGE(TAG, "Audio: playback device failed to open");
+        }
+        if(recordDev.Open() < 0)
+        {
+            LOGE(TAG, "Audio: capture device failed to open");
+        }
+        LOGD(TAG, "Audio: separate devices, open {:.1f} + {:.1f} ms, playback buffer {:.1f} ms, capture buffer {:.1f} ms",
+            playDev.open_ms, recordDev.open_ms, playDev.latency_ms, recordDev.latency_ms);
+    }
+    LOGD(TAG, "Audio: playback {}", playDev.report);
+    LOGD(TAG, "Audio: capture {}", recordDev.report);
 #if 0   
     AiConfigs ai_configs("localai.json");
     LOGL(TAG);
@@ -776,8 +877,32 @@ int main(int argc, char *argv[])
 #else
     AiSoundTask(lcm, playDev, recordDev);
 #endif
-    playDev.Close();
-    recordDev.Close();
+#ifdef AIXD_ALSA_MMAP
+    if(audio_watch.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(audio_mutex);
+            audio_done = true;
+        }
+        audio_cv.notify_one();
+        audio_watch.join();
+    }
+    if(alsa_mmap)
+    {
+        alsaDev.Close();
+        LOGD(TAG, "Audio: ALSA xruns playback {} capture {}", alsaDev.xruns[0].load(), alsaDev.xruns[1].load());
+    }
+    else
+#endif
+    if(duplex)
+    {
+        duplexDev.Close();
+    }
+    else
+    {
+        playDev.Close();
+        recordDev.Close();
+    }
     return 0;
 }
 #endif
@@ -12,11 +12,12 @@ void AiSoundTask(lcm::LCM &lcm, PlayDev &playDev, RecordDev &recordDev)
         ai_configs["system"]["prompt"].dump(),
         ai_configs["system"]["hello"].get<std::string>(),
         &lcm, &playDev, &recordDev, &local_ai);
+    engine.ConfigBeam(ai_configs["beamformer"]);
+    engine.ConfigAec(ai_configs["aec"]);
+    engine.ConfigVad(ai_configs["vad"]);
+    engine.ConfigKws(ai_configs["wakeword"]);
+    engine.ConfigPreroll(ai_configs["preroll"]);
+    engine.ConfigBargeIn(ai_configs["barge_in"]);
     engine.Connect(false);
-
-    while(true)
-    {
-        engine.Poll();
-        lcm.handleTimeout(10);
-    }
+    engine.Run();
 }
\ No newline at end of file